@@ -16,6 +16,9 @@ void app_exit(void);
 // register a scheduler callback.
 void app_set_scheduler(app_run_func func, void* data);
 
+// wake the main loop so the scheduler runs; safe from any thread.
+void app_wake(void);
+
 // enable exhaustive heap checking in debug builds.
 void app_heap_check();
 
@@ -10,12 +10,14 @@ HINSTANCE g_hInstance = 0;
 static app_run_func g_app_func = 0;
 static void* g_app_data = 0;
 static bool g_app_running = true;
+static DWORD g_app_thread = 0;
 
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hInstPrev, LPSTR lpCmdLine, int nCmdShow)
 {
     MSG msg;
 
     g_hInstance = hInstance;
+    g_app_thread = GetCurrentThreadId();
     InitCommonControls();
 
     init();
@@ -75,6 +77,12 @@ void app_set_scheduler(app_run_func func, void* data)
 	g_app_data = data;
 }
 
+void app_wake()
+{
+	// any message ends the idle wait in the main loop.
+	PostThreadMessage(g_app_thread, WM_NULL, 0, 0);
+}
+
 void app_exit()
 {
 	PostQuitMessage(0);
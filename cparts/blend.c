@@ -71,11 +71,27 @@ void span4_colp_add(byte* dst, int len, RGBA col);
 void span8_col_copy(RGBA16* dst, int len, RGBA16 col);
 void span8_col_over(RGBA16* dst, int len, RGBA16 col);
 
+void span2_col_copy(uint16* dst, int len, int a);
+void span2_col_over(uint16* dst, int len, int a);
+
 //void span4_linear_copy(byte* dst, int len, RGBA c1, RGBA c2, int t0, int dt);
 //void span4_linear_over(byte* dst, int len, RGBA c1, RGBA c2, int t0, int dt);
 //void span4_linear_add(byte* dst, int len, RGBA c1, RGBA c2, int t0, int dt);
 
 
+// Coverage Mask.
+
+void span8_mask_over(RGBA16* dst, int len, const byte* cov, RGBA16 col);
+void span2_mask_over(uint16* dst, int len, const byte* cov, int a);
+void span_a8_lerp(byte* dst, const byte* a, const byte* b, int len, int f);
+
+
+// Upsampling.
+
+void span2_lerp(uint16* dst, const uint16* a, const uint16* b, int len, int f);
+void span2_expand(uint16* dst, const uint16* src, int len, int channels, int shift);
+
+
 // Direct 1:1
 
 void span4_4_copy(byte* dst, int len, byte* src, int alpha);
@@ -134,6 +150,11 @@ let U16MUL_A1(A,B) = ((UIF32(A)*(B))>>16)
 let OVER_P(A,B,b) = ( (B) + U8MUL_A1(256-(b),(A)) )
 let OVER16_P(A,B,b) = ( (B) + U16MUL_A1(65536-(b),(A)) )
 
+// composite pre-multiplied B over pre-multiplied 16-bit A with saturation.
+// rounds (1-b)A up where OVER16_P rounds it down, so that b=0 needs no
+// special case; matches the PMULHUW/PSUBW/PADDUSW sequence in simd.c.
+let OVERSAT16_P(A,B,b) = { uint_fast32_t t=UIF32(B)+(A)-U16MUL_A1((b),(A)); (A)=(t<=65535)?t:65535; }
+
 // sum A and B with saturation.
 let ADD_SAT(A,B) = {unsigned int t=(A); t+=(B); (A)=(t<=255)?t:255;}
 
@@ -315,6 +336,93 @@ void span8_col_over(RGBA16* dst, int len, RGBA16 col)
 	}
 }
 
+void span2_col_copy(uint16* dst, int len, int a)
+{
+	while (len--) *dst++ = (uint16)a;
+}
+
+void span2_col_over(uint16* dst, int len, int a)
+{
+	// coverage only: the alpha channel of span8_col_over.
+	while (len--) {
+		*dst = (uint16)OVER16_P(*dst, a, a);
+		++dst;
+	}
+}
+
+
+// Coverage Mask.
+
+void span8_mask_over(RGBA16* dst, int len, const byte* cov, RGBA16 col)
+{
+	// scale pre-multiplied colour B by coverage, then B over A.
+	while (len--) {
+		uint_fast32_t k = UIF32(*cov++) * 257; // [0,255] -> [0,65535]
+		if (k) {
+			uint_fast32_t a = U16MUL_A1(k, col.a);
+			OVERSAT16_P(dst->r, U16MUL_A1(k, col.r), a);
+			OVERSAT16_P(dst->g, U16MUL_A1(k, col.g), a);
+			OVERSAT16_P(dst->b, U16MUL_A1(k, col.b), a);
+			OVERSAT16_P(dst->a, a, a);
+		}
+		++dst;
+	}
+}
+
+void span2_mask_over(uint16* dst, int len, const byte* cov, int a)
+{
+	// coverage only: the alpha channel of span8_mask_over.
+	while (len--) {
+		uint_fast32_t k = UIF32(*cov++) * 257; // [0,255] -> [0,65535]
+		if (k) {
+			uint_fast32_t b = U16MUL_A1(k, a);
+			OVERSAT16_P(*dst, b, b);
+		}
+		++dst;
+	}
+}
+
+void span_a8_lerp(byte* dst, const byte* a, const byte* b, int len, int f)
+{
+	// linear blend of two alpha spans, f in [0,255] towards b.
+	int g = 256 - f;
+	while (len--) {
+		*dst++ = (byte)((*a++ * g + *b++ * f) >> 8);
+	}
+}
+
+
+// Upsampling.
+
+// a - a*f/256 + b*f/256 rather than (a*(256-f) + b*f)/256, so that
+// every product fits in 16 bits for PMULHUW (see simd.c).
+let LERP16(A,B,F) = ((A) - (((A)*(F))>>8) + (((B)*(F))>>8))
+
+void span2_lerp(uint16* dst, const uint16* a, const uint16* b, int len, int f)
+{
+	// linear blend of two 16-bit spans, f in [0,255] towards b.
+	while (len--) {
+		uint_fast32_t x = *a++, y = *b++;
+		*dst++ = (uint16)LERP16(x, y, (uint_fast32_t)f);
+	}
+}
+
+void span2_expand(uint16* dst, const uint16* src, int len, int channels, int shift)
+{
+	// upsample len pixels of 16-bit channels by 1<<shift, blending
+	// each pixel towards the next; reads len+1 source pixels.
+	int n = 1 << shift, step = 256 >> shift, i, k, c;
+	for (i=0; i<len; i++, src += channels) {
+		for (k=0; k<n; k++) {
+			uint_fast32_t f = k * step;
+			for (c=0; c<channels; c++) {
+				uint_fast32_t x = src[c], y = src[channels+c];
+				*dst++ = (uint16)LERP16(x, y, f);
+			}
+		}
+	}
+}
+
 
 // Direct 1:1
 
@@ -0,0 +1,260 @@
+#include "defs.h"
+#include "surface.h"
+#include "blend.h"
+#include "simd.h"
+#include "brushstamp.h"
+
+// Each level is a 2x2 box filter of the level above it, down to 1x1.
+// Sampling is separable: two source rows are blended with the vertical
+// weight (SIMD, many texels per instruction) into a zero-padded row,
+// then each output pixel takes a horizontal lerp from that row.
+
+struct BrushStampTarget {
+	byte* row;			// vertically blended row, one zero texel each side.
+	int rowSize;		// allocated size of row.
+	SurfaceData out;	// rendered coverage; data is over-allocated.
+	size_t outSize;		// allocated size of out.data.
+};
+
+struct BrushStamp {
+	SurfaceData levels[BRUSHSTAMP_MAX_LEVELS];
+	int numLevels;
+	byte* zero;			// a row of zero texels (outside the brush.)
+	BrushStampTarget* target; // for brushstamp_render.
+};
+
+static void brushstamp_downsample(SurfaceData* to, const SurfaceData* from)
+{
+	// 2x2 box filter; odd edges repeat the last texel.
+	int width = (from->width + 1) >> 1, height = (from->height + 1) >> 1;
+	int x, y;
+	surface_create(to, surface_a8, width, height);
+	for (y=0; y<height; y++) {
+		const byte* r0 = from->data + (y*2) * from->stride;
+		const byte* r1 = (y*2+1 < from->height) ? r0 + from->stride : r0;
+		byte* dst = to->data + y * to->stride;
+		for (x=0; x<width; x++) {
+			int x0 = x*2, x1 = (x*2+1 < from->width) ? x0+1 : x0;
+			dst[x] = (byte)((r0[x0] + r0[x1] + r1[x0] + r1[x1] + 2) >> 2);
+		}
+	}
+}
+
+BrushStamp* brushstamp_create(const SurfaceData* brush)
+{
+	BrushStamp* bs = cpart_new(BrushStamp);
+	SurfaceData* level = &bs->levels[0];
+	int y;
+	assert(brush->format == surface_a8);
+	assert(brush->width > 0 && brush->height > 0);
+	// level zero is a tightly packed copy of the brush.
+	surface_create(level, surface_a8, brush->width, brush->height);
+	for (y=0; y<brush->height; y++)
+		memcpy(level->data + y * level->stride, brush->data + y * brush->stride, brush->width);
+	bs->numLevels = 1;
+	while ((level->width > 1 || level->height > 1) &&
+		   bs->numLevels < BRUSHSTAMP_MAX_LEVELS) {
+		brushstamp_downsample(level + 1, level);
+		++level; ++bs->numLevels;
+	}
+	bs->zero = cpart_alloc(brush->width + 2);
+	cpart_zero(bs->zero, brush->width + 2);
+	bs->target = brushstamp_create_target();
+	return bs;
+}
+
+BrushStampTarget* brushstamp_create_target()
+{
+	BrushStampTarget* t = cpart_new(BrushStampTarget);
+	surfaceInitInvalid(&t->out);
+	t->out.data = 0;
+	t->outSize = 0;
+	t->row = 0;
+	t->rowSize = 0;
+	return t;
+}
+
+void brushstamp_destroy_target(BrushStampTarget* t)
+{
+	cpart_free(t->row);
+	cpart_free(t->out.data);
+	cpart_free(t);
+}
+
+void brushstamp_destroy(BrushStamp* bs)
+{
+	int i;
+	for (i=0; i<bs->numLevels; i++)
+		surface_destroy(&bs->levels[i]);
+	cpart_free(bs->zero);
+	brushstamp_destroy_target(bs->target);
+	cpart_free(bs);
+}
+
+typedef void (*span_a8_lerp_func)(byte* dst, const byte* a, const byte* b, int len, int f);
+
+// 0 until the first render, then the selected span function.
+static span_a8_lerp_func s_lerp = 0;
+
+const SurfaceData* brushstamp_render(BrushStamp* bs, int size, int fx, int fy)
+{
+	return brushstamp_render_to(bs, bs->target, size, fx, fy, 0);
+}
+
+static const SurfaceData* brushstamp_level(const BrushStamp* bs, int size)
+{
+	// pick the smallest level that is no smaller than the dab, so
+	// bilinear sampling never skips texels.
+	const SurfaceData* level = &bs->levels[0];
+	int i;
+	for (i=1; i<bs->numLevels; i++) {
+		const SurfaceData* next = &bs->levels[i];
+		if ((next->width << 8) < size || (next->height << 8) < size) break;
+		level = next;
+	}
+	return level;
+}
+
+static void brushstamp_size_output(BrushStampTarget* t, int side, int fx, int fy,
+	const iRect* clip, iRect* r)
+{
+	// output covers the dab bounds from (fx,fy) within the first pixel,
+	// or the part of them inside the clip rect.
+	size_t need;
+	r->left = 0; r->top = 0;
+	r->right = BRUSHSTAMP_EXTENT(side, fx);
+	r->bottom = BRUSHSTAMP_EXTENT(side, fy);
+	if (clip) {
+		if (clip->left > r->left) r->left = clip->left;
+		if (clip->top > r->top) r->top = clip->top;
+		if (clip->right < r->right) r->right = clip->right;
+		if (clip->bottom < r->bottom) r->bottom = clip->bottom;
+		if (r->right < r->left) r->right = r->left;
+		if (r->bottom < r->top) r->bottom = r->top;
+	}
+	need = (size_t)(r->right - r->left) * (r->bottom - r->top);
+	if (need > t->outSize) {
+		cpart_free(t->out.data);
+		t->out.data = cpart_alloc(need);
+		t->outSize = need;
+	}
+	t->out.format = surface_a8;
+	t->out.width = r->right - r->left; t->out.height = r->bottom - r->top;
+	t->out.stride = t->out.width;
+}
+
+const SurfaceData* brushstamp_render_to(const BrushStamp* bs, BrushStampTarget* t,
+	int size, int fx, int fy, const iRect* clip)
+{
+	const SurfaceData* level;
+	iRect r;
+	int x0, y0, width, height, lw, lh, ix, iy;
+	int64 u0, du, v, dv;
+
+	assert(size > 0 && fx >= 0 && fx < 256 && fy >= 0 && fy < 256);
+	if (!s_lerp)
+		s_lerp = cpu_supports_sse2() ? span_a8_lerp_sse2 : span_a8_lerp;
+
+	level = brushstamp_level(bs, size);
+	lw = level->width; lh = level->height;
+
+	brushstamp_size_output(t, size, fx, fy, clip, &r);
+	x0 = r.left; y0 = r.top;
+	width = t->out.width; height = t->out.height;
+	if (lw + 2 > t->rowSize) {
+		cpart_free(t->row);
+		t->row = cpart_alloc(lw + 2);
+		t->rowSize = lw + 2;
+	}
+
+	// map output pixel centres to texel space in 16.16, where texel
+	// centres are at +0.5; one output pixel is 256 Q8 units.
+	du = ((int64)lw << 24) / size;
+	dv = ((int64)lh << 24) / size;
+	u0 = (((int64)(128 - fx) * lw) << 16) / size - 0x8000 + x0 * du;
+	v = (((int64)(128 - fy) * lh) << 16) / size - 0x8000 + y0 * dv;
+
+	for (iy=0; iy<height; iy++, v+=dv) {
+		byte* dst = t->out.data + iy * width;
+		int j = (int)(v >> 16), f = (int)(v >> 8) & 255;
+		const byte* r0 = (j >= 0 && j < lh) ? level->data + j * level->stride : bs->zero;
+		const byte* r1 = (j+1 >= 0 && j+1 < lh) ? level->data + (j+1) * level->stride : bs->zero;
+		int64 u = u0;
+		if (r0 == bs->zero && r1 == bs->zero) {
+			memset(dst, 0, width);
+			continue;
+		}
+		// blend the two rows; texels -1 and lw stay zero.
+		t->row[0] = 0; t->row[lw+1] = 0;
+		s_lerp(t->row + 1, r0, r1, lw, f);
+		for (ix=0; ix<width; ix++, u+=du) {
+			int k = (int)(u >> 16), g = (int)(u >> 8) & 255;
+			if (k >= -1 && k < lw) {
+				const byte* p = t->row + 1 + k;
+				dst[ix] = (byte)((p[0] * (256-g) + p[1] * g) >> 8);
+			}
+			else dst[ix] = 0;
+		}
+	}
+
+	return &t->out;
+}
+
+int brushstamp_turned_size(int size, const BrushStampTurn* tn)
+{
+	// the bounding box of the turned square, rounded up.
+	int ax = abs(tn->ux) + abs(tn->vx), ay = abs(tn->uy) + abs(tn->vy);
+	int a = (ax > ay) ? ax : ay;
+	return (int)(((int64)size * a + 16383) >> 14);
+}
+
+static int brushstamp_texel(const SurfaceData* level, int k, int j)
+{
+	// zero outside the brush.
+	if (k < 0 || k >= level->width || j < 0 || j >= level->height)
+		return 0;
+	return level->data[j * level->stride + k];
+}
+
+const SurfaceData* brushstamp_render_turned(const BrushStamp* bs, BrushStampTarget* t,
+	int size, int fx, int fy, const BrushStampTurn* tn, const iRect* clip)
+{
+	const SurfaceData* level;
+	iRect r;
+	int half, lw, lh, ix, iy;
+	int64 cu, cv;
+
+	assert(size > 0 && fx >= 0 && fx < 256 && fy >= 0 && fy < 256);
+	level = brushstamp_level(bs, size);
+	lw = level->width; lh = level->height;
+	half = brushstamp_turned_size(size, tn) >> 1;
+	brushstamp_size_output(t, brushstamp_turned_size(size, tn), fx, fy, clip, &r);
+
+	// each output pixel centre, from the centre of the dab (Q8), is
+	// turned back onto the brush: the axes are orthonormal, so the
+	// inverse is the transpose. texel space is 16.16 as above, where
+	// the brush's centre is at (lw-1)/2, (lh-1)/2.
+	cu = (int64)(lw - 1) << 15;
+	cv = (int64)(lh - 1) << 15;
+	for (iy=r.top; iy<r.bottom; iy++) {
+		byte* dst = t->out.data + (iy - r.top) * t->out.stride;
+		int64 dy = (int64)iy * 256 + 128 - fy - half;
+		for (ix=r.left; ix<r.right; ix++) {
+			int64 dx = (int64)ix * 256 + 128 - fx - half;
+			int64 u = ((dx * tn->ux + dy * tn->uy) * lw * 4) / size + cu;
+			int64 v = ((dx * tn->vx + dy * tn->vy) * lh * 4) / size + cv;
+			int k = (int)(u >> 16), g = (int)(u >> 8) & 255;
+			int j = (int)(v >> 16), f = (int)(v >> 8) & 255;
+			int a, b;
+			if (k < -1 || k >= lw || j < -1 || j >= lh) {
+				*dst++ = 0;
+				continue;
+			}
+			a = brushstamp_texel(level, k, j) * (256-g) + brushstamp_texel(level, k+1, j) * g;
+			b = brushstamp_texel(level, k, j+1) * (256-g) + brushstamp_texel(level, k+1, j+1) * g;
+			*dst++ = (byte)((a * (256-f) + b * f) >> 16);
+		}
+	}
+
+	return &t->out;
+}
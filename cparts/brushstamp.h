@@ -0,0 +1,56 @@
+#ifndef CPART_BRUSHSTAMP
+#define CPART_BRUSHSTAMP
+
+
+// Brush stamps.
+
+// An alpha-only brush image prefiltered into a mip pyramid, so it can
+// be stamped at any size: each dab samples the nearest level that is
+// no smaller than the dab, bilinearly, so the cost per covered pixel
+// does not depend on the size of the dab.
+
+#define BRUSHSTAMP_MAX_LEVELS 16
+
+typedef struct BrushStamp BrushStamp;
+
+// build the pyramid from a surface_a8 brush; the brush is copied.
+BrushStamp* brushstamp_create(const SurfaceData* brush);
+void brushstamp_destroy(BrushStamp* bs);
+
+// render the brush coverage scaled to a square dab of size (Q8).
+// fx,fy: offset of the dab bounds within the first pixel, Q8 [0,255].
+// returns a surface_a8 mask valid until the next render call.
+const SurfaceData* brushstamp_render(BrushStamp* bs, int size, int fx, int fy);
+
+// width or height in pixels of a dab rendered at size with offset f.
+#define BRUSHSTAMP_EXTENT(size, f) (((f) + (size) + 255) >> 8)
+
+// render targets let several threads render one stamp at once.
+typedef struct BrushStampTarget BrushStampTarget;
+BrushStampTarget* brushstamp_create_target();
+void brushstamp_destroy_target(BrushStampTarget* t);
+
+// as brushstamp_render, into t, and only the part of the dab inside
+// clip (pixels from the top-left of the dab) if clip is not 0; the
+// pixels rendered match those of a full render exactly.
+const SurfaceData* brushstamp_render_to(const BrushStamp* bs, BrushStampTarget* t,
+	int size, int fx, int fy, const iRect* clip);
+
+// the linear part of a transform that turns the brush about the centre
+// of its dab: where the brush's x and y axes go, Q14, of unit length
+// (a rotation, or a mirror and a rotation).
+typedef struct BrushStampTurn {
+	int ux, uy, vx, vy;
+} BrushStampTurn;
+
+// side (Q8) of the square dab that holds a brush of size turned by tn.
+int brushstamp_turned_size(int size, const BrushStampTurn* tn);
+
+// as brushstamp_render_to, with the brush turned by tn. size is that of
+// the brush; fx, fy and clip are relative to the bounds of the turned
+// dab (see brushstamp_turned_size). sampled per pixel, so slower.
+const SurfaceData* brushstamp_render_turned(const BrushStamp* bs, BrushStampTarget* t,
+	int size, int fx, int fy, const BrushStampTurn* tn, const iRect* clip);
+
+
+#endif
@@ -0,0 +1,168 @@
+#include "defs.h"
+#include "surface.h"
+#include "blend.h"
+#include "simd.h"
+#include "dabmask.h"
+
+// Masks are kept in a small direct-mapped cache. Strokes touch a narrow
+// band of sizes (pressure) and all phases, so a miss is rare once the
+// stroke is under way; a slot is rebuilt in place on collision.
+
+// Coverage is exact for interior and exterior pixels, and 8x8
+// super-sampled along the edge, which also gives sensible results
+// for dabs smaller than one pixel.
+
+#define DABMASK_SLOTS 256
+#define DABMASK_SAMPLES 8
+
+typedef struct DabMaskSlot DabMaskSlot;
+struct DabMaskSlot {
+	int key; // -1 when empty.
+	SurfaceData mask;
+};
+
+struct DabMaskCache {
+	DabMaskSlot slots[DABMASK_SLOTS];
+};
+
+DabMaskCache* dabmask_create_cache()
+{
+	DabMaskCache* mc = cpart_new(DabMaskCache);
+	int i;
+	for (i=0; i<DABMASK_SLOTS; i++) {
+		mc->slots[i].key = -1;
+		surfaceInitInvalid(&mc->slots[i].mask);
+	}
+	return mc;
+}
+
+void dabmask_destroy_cache(DabMaskCache* mc)
+{
+	int i;
+	for (i=0; i<DABMASK_SLOTS; i++) {
+		if (surfaceValid(&mc->slots[i].mask))
+			surface_destroy(&mc->slots[i].mask);
+	}
+	cpart_free(mc);
+}
+
+static void dabmask_build(SurfaceData* sd, int size, int fx, int fy)
+{
+	// the dab bounding box starts at (fx,fy) steps within the mask.
+	const float step = 1.0f / DABMASK_STEPS;
+	const float sub = 1.0f / DABMASK_SAMPLES;
+	float r = size * step * 0.5f;
+	float cx = fx * step + r, cy = fy * step + r;
+	float r2 = r * r;
+	// pixels whose centre is this close to the edge are partial.
+	float inner = r - 0.7072f, outer = r + 0.7072f;
+	float in2 = (inner > 0) ? inner * inner : -1.0f;
+	float out2 = outer * outer;
+	int width = DABMASK_EXTENT(size, fx);
+	int height = DABMASK_EXTENT(size, fy);
+	int ix, iy, sx, sy;
+	byte* row;
+
+	surface_create(sd, surface_a8, width, height);
+	row = sd->data;
+	for (iy=0; iy<height; iy++) {
+		for (ix=0; ix<width; ix++) {
+			float dx = ix + 0.5f - cx, dy = iy + 0.5f - cy;
+			float d2 = dx*dx + dy*dy;
+			if (d2 <= in2) row[ix] = 255;
+			else if (d2 >= out2) row[ix] = 0;
+			else {
+				// count the sub-samples inside the circle.
+				int n = 0;
+				for (sy=0; sy<DABMASK_SAMPLES; sy++) {
+					float py = iy + (sy + 0.5f) * sub - cy;
+					for (sx=0; sx<DABMASK_SAMPLES; sx++) {
+						float px = ix + (sx + 0.5f) * sub - cx;
+						if (px*px + py*py < r2) ++n;
+					}
+				}
+				row[ix] = (byte)((n * 255 + (DABMASK_SAMPLES*DABMASK_SAMPLES/2))
+								 / (DABMASK_SAMPLES*DABMASK_SAMPLES));
+			}
+		}
+		row += sd->stride;
+	}
+}
+
+const SurfaceData* dabmask_get(DabMaskCache* mc, int size, int fx, int fy)
+{
+	int key = (size << 4) | (fy << 2) | fx;
+	DabMaskSlot* slot = &mc->slots[(uint32)(key * 2654435761u) >> 24];
+	assert(size >= 1 && size <= DABMASK_MAX_SIZE * DABMASK_STEPS);
+	assert(fx >= 0 && fx < DABMASK_STEPS && fy >= 0 && fy < DABMASK_STEPS);
+	if (slot->key != key) {
+		if (surfaceValid(&slot->mask))
+			surface_destroy(&slot->mask);
+		dabmask_build(&slot->mask, size, fx, fy);
+		slot->key = key;
+	}
+	return &slot->mask;
+}
+
+
+// blending.
+
+typedef void (*span8_mask_func)(RGBA16* dst, int len, const byte* cov, RGBA16 col);
+
+typedef void (*span2_mask_func)(uint16* dst, int len, const byte* cov, int a);
+
+// 0 until the first blend, then the selected span functions.
+static span8_mask_func s_maskOver = 0;
+static span2_mask_func s_maskOverA16 = 0;
+
+void dabmask_blend_rgba16(SurfaceData* sd, int x, int y, const SurfaceData* mask, RGBA16 col)
+{
+	// clip mask rect to surface.
+	int ox = 0, oy = 0;
+	int width = mask->width, height = mask->height;
+	assert(sd->format == surface_rgba16 && mask->format == surface_a8);
+	if (!s_maskOver)
+		s_maskOver = cpu_supports_sse2() ? span8_mask_over_sse2 : span8_mask_over;
+	if (x < 0) { ox -= x; width += x; x = 0; }
+	if (y < 0) { oy -= y; height += y; y = 0; }
+	if (width > 0 && height > 0) {
+		// x,y are >= 0, width,height are > 0.
+		if (width > sd->width - x) width = sd->width - x;
+		if (height > sd->height - y) height = sd->height - y;
+		if (width > 0 && height > 0) {
+			byte* to = sd->data + (y * sd->stride) + (x * 8);
+			const byte* from = mask->data + (oy * mask->stride) + ox;
+			while (height--) {
+				s_maskOver((RGBA16*)to, width, from, col);
+				to += sd->stride;
+				from += mask->stride;
+			}
+		}
+	}
+}
+
+void dabmask_blend_a16(SurfaceData* sd, int x, int y, const SurfaceData* mask, int a)
+{
+	// clip mask rect to surface.
+	int ox = 0, oy = 0;
+	int width = mask->width, height = mask->height;
+	assert(sd->format == surface_a16 && mask->format == surface_a8);
+	if (!s_maskOverA16)
+		s_maskOverA16 = cpu_supports_sse2() ? span2_mask_over_sse2 : span2_mask_over;
+	if (x < 0) { ox -= x; width += x; x = 0; }
+	if (y < 0) { oy -= y; height += y; y = 0; }
+	if (width > 0 && height > 0) {
+		// x,y are >= 0, width,height are > 0.
+		if (width > sd->width - x) width = sd->width - x;
+		if (height > sd->height - y) height = sd->height - y;
+		if (width > 0 && height > 0) {
+			byte* to = sd->data + (y * sd->stride) + (x * 2);
+			const byte* from = mask->data + (oy * mask->stride) + ox;
+			while (height--) {
+				s_maskOverA16((uint16*)to, width, from, a);
+				to += sd->stride;
+				from += mask->stride;
+			}
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef CPART_DABMASK
+#define CPART_DABMASK
+
+
+// Dab coverage masks.
+
+// Anti-aliased round dab masks, cached per (size, sub-pixel phase).
+// Sizes and positions are quantized to DABMASK_STEPS per pixel, so a
+// dab becomes one cache lookup plus one blend of the mask.
+
+#define DABMASK_STEPS 4			// sub-pixel steps per pixel.
+#define DABMASK_MAX_SIZE 64		// largest cached diameter in pixels.
+
+// width or height in pixels of a mask of size steps at offset f.
+#define DABMASK_EXTENT(size, f) (((f) + (size) + (DABMASK_STEPS-1)) / DABMASK_STEPS)
+
+typedef struct DabMaskCache DabMaskCache;
+
+DabMaskCache* dabmask_create_cache();
+void dabmask_destroy_cache(DabMaskCache* mc);
+
+// find or build the surface_a8 coverage mask for a round dab.
+// size: diameter in steps, [1, DABMASK_MAX_SIZE*DABMASK_STEPS].
+// fx,fy: offset of the dab bounds within the mask's first pixel,
+// in steps [0, DABMASK_STEPS).
+// the mask remains valid until the next dabmask_get call.
+const SurfaceData* dabmask_get(DabMaskCache* mc, int size, int fx, int fy);
+
+// blend a pre-multiplied colour scaled by mask coverage over an
+// rgba16 surface with its top-left at (x,y); clips to the surface.
+void dabmask_blend_rgba16(SurfaceData* sd, int x, int y, const SurfaceData* mask, RGBA16 col);
+
+// as above for an a16 coverage surface; a is the dab alpha [0,65535].
+void dabmask_blend_a16(SurfaceData* sd, int x, int y, const SurfaceData* mask, int a);
+
+
+#endif
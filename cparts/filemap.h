@@ -0,0 +1,26 @@
+#ifndef CPART_FILEMAP
+#define CPART_FILEMAP
+
+
+// Mapped files.
+
+// A scratch file seen through a window: only the part of the file being
+// read or written is mapped at a time, so the file can be far larger
+// than the address space it takes, and its pages are written back to
+// disk by the system as memory is needed. The file is deleted when the
+// map is destroyed.
+
+typedef struct FileMap FileMap;
+
+// maps at least window bytes at a time; 0 if the file cannot be created
+// at this size.
+FileMap* filemap_create_temp(size_t size, size_t window);
+void filemap_destroy(FileMap* fm);
+
+// the address of [offset, offset+len) in the file, moving the window to
+// it if need be; valid until the next call. 0 if it cannot be mapped.
+void* filemap_view(FileMap* fm, size_t offset, size_t len);
+size_t filemap_size(FileMap* fm);
+
+
+#endif
@@ -0,0 +1,91 @@
+#include "defs.h"
+#include "filemap.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+
+struct FileMap {
+	HANDLE file;
+	HANDLE mapping;
+	size_t size;
+	size_t window;		// bytes to map at a time, at least.
+	size_t granularity;	// views start on a multiple of this.
+	byte* view;			// the mapped part of the file, or 0.
+	size_t viewStart, viewSize;
+};
+
+FileMap* filemap_create_temp(size_t size, size_t window)
+{
+	char dir[MAX_PATH], path[MAX_PATH];
+	SYSTEM_INFO si;
+	FileMap* fm;
+	if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "skp", 0, path))
+		return 0;
+	fm = cpart_new(FileMap);
+	fm->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (fm->file != INVALID_HANDLE_VALUE) {
+		// the mapping extends the file to its size; views of it take
+		// address space only as they are mapped.
+		fm->mapping = CreateFileMappingA(fm->file, NULL, PAGE_READWRITE,
+			(DWORD)((uint64)size >> 32), (DWORD)size, NULL);
+	}
+	if (!fm->mapping) {
+		filemap_destroy(fm);
+		return 0;
+	}
+	GetSystemInfo(&si);
+	fm->granularity = si.dwAllocationGranularity;
+	fm->size = size;
+	fm->window = (window < size) ? window : size;
+	return fm;
+}
+
+void filemap_destroy(FileMap* fm)
+{
+	if (fm->view)
+		UnmapViewOfFile(fm->view);
+	if (fm->mapping)
+		CloseHandle(fm->mapping);
+	if (fm->file && fm->file != INVALID_HANDLE_VALUE)
+		CloseHandle(fm->file);
+	cpart_free(fm);
+}
+
+void* filemap_view(FileMap* fm, size_t offset, size_t len)
+{
+	size_t start, end;
+	if (offset > fm->size || len > fm->size - offset)
+		return 0;
+	if (fm->view && offset >= fm->viewStart &&
+		offset + len <= fm->viewStart + fm->viewSize)
+		return fm->view + (offset - fm->viewStart);
+	if (fm->view) {
+		UnmapViewOfFile(fm->view);
+		fm->view = 0;
+	}
+	// centre the window on the range, so stepping either way through
+	// the file remaps once per window.
+	start = (offset + len / 2 > fm->window / 2) ? offset + len / 2 - fm->window / 2 : 0;
+	if (start > offset)
+		start = offset;
+	start -= start % fm->granularity;
+	end = start + fm->window;
+	if (end < offset + len)
+		end = offset + len;
+	if (end > fm->size)
+		end = fm->size;
+	fm->view = MapViewOfFile(fm->mapping, FILE_MAP_WRITE,
+		(DWORD)((uint64)start >> 32), (DWORD)start, end - start);
+	if (!fm->view)
+		return 0;
+	fm->viewStart = start;
+	fm->viewSize = end - start;
+	return fm->view + (offset - start);
+}
+
+size_t filemap_size(FileMap* fm)
+{
+	return fm->size;
+}
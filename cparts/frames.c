@@ -24,10 +24,26 @@ struct FrameBlendImage {
 	BlendMode mode;		// blend mode.
 	int alpha;		    // blend alpha [0,255]
 	SurfaceData* image;	// the source image to blend.
+	RGBA col;			// colour of a surface_a16 coverage image.
 	iRect source;		// area of sorce image in pixels.
 	iRect dest;			// area of the destination frame in pixels.
 };
 
+struct FrameTile {
+	int index;			// in the layer's grid of tiles.
+	SurfaceData pixels;	// rgba8; owned, except as given by frameGetTiles.
+};
+
+struct FrameTileChanged {
+	ref Frame layer;
+	int index;			// in the layer's grid of tiles, or -1 for all.
+};
+
+struct FrameTiles {
+	FrameTile* tiles;	// cpart_alloc'd; owned by whoever holds it.
+	int count;
+};
+
 export enum FrameMessage {
 	frameRender,	// FrameRenderRequest*
 	frameHitTest,	// FrameHitTest*
@@ -48,6 +64,14 @@ export enum FrameMessage {
 	frameGetAffine, // float*
 	frameSetRenderContext, // RenderContext*
 	frameBlendImage, // FrameBlendImage*
+	frameSetScale,  // int*
+	frameKeepTiles, // bool*
+	frameTakeTiles, // FrameTiles*
+	frameGetTiles, // FrameTiles*
+	frameUpdateTiles, // FrameTiles*: copies the pixels.
+	frameTileChanged, // FrameTileChanged*: sent to ancestors.
+	frameSetActive, // ref Frame: the layer being painted.
+	frameSetOverlay, // ref Frame: drawn just above the active layer; not a child.
 } FrameMessage;
 
 let FrameMessageFunc = type (ref Frame, FrameMessage, ref any) -> int;
@@ -186,12 +210,22 @@ struct BoxFrame {
 void box_draw(Boxref Frame f, FrameRenderRequest* r)
 {
 	FrameRenderRequest req;
+	fRect clip;
 	req.draw = r.draw;
 	req.clip = r.clip;
 	req.alpha = r.alpha * f.alpha;
 
 	if (f.show && req.alpha > 0)
 	{
+		// children see the clip in their own space.
+		if (r.clip) {
+			clip.left = r.clip.left - f.rect.left;
+			clip.top = r.clip.top - f.rect.top;
+			clip.right = r.clip.right - f.rect.left;
+			clip.bottom = r.clip.bottom - f.rect.top;
+			req.clip = &clip;
+		}
+
 		// push state to save transform.
 		GfxDraw_save(req.draw);
 
@@ -285,20 +319,139 @@ export ref Frame frame_create_box(ref Frame parent)
 
 // layer frame.
 
+// what the compositor needs to know about a cell, kept up to date as it
+// is written: strokes adjust the count from the rect they blend into,
+// and anything that replaces a tile's pixels counts them again. only
+// the part of a cell inside the layer counts.
+struct LayerCell {
+	int translucent;	// pixels with alpha below 255; opaque at 0.
+	bool uniform;		// every pixel is colour.
+	uint32 colour;		// rgba8 pre-multiplied, as stored.
+};
+
 struct LayerFrame {
 	Frame frame;
-	GfxImage* grid; // array of GfxImage.
+	GfxImage* grid; // array of GfxImage; 0 for empty cells.
+	SurfaceData* pixels; // per tile: the layer's own pixels, which grid shows.
+	LayerCell* cells; // per tile.
 	GfxContext rc; // TODO: link to FrameContext.
 	GfxBlendMode mode;
 	float alpha;
 	float x, y;
 	int width, height;
 	int tilesX, tilesY;
+	int scale; // log2 of document pixels per layer pixel.
 	bool show;
+	// with keep set, blending into a tile for the first time keeps a
+	// copy of its pixels, for undo.
+	bool keep;
+	byte* touched; // per tile: replaced since the last frameTakeTiles.
+	FrameTile* kept;
+	int numKept, maxKept;
 };
 
 const int c_tileSize = 256;
 
+// layers start with no tiles: an empty cell has no image and no pixels,
+// and reads as these, which are shared by every empty cell of every
+// layer. a cell gets its tile the first time it is written, and loses
+// it again when a stroke or undo leaves it clear.
+byte* g_transparent = 0;
+
+iPair f_cell_extent(int width, int height, int index)
+{
+	// the part of a cell inside the layer.
+	int tilesX = (width + (c_tileSize-1)) / c_tileSize;
+	int ix = index % tilesX, iy = index / tilesX;
+	iPair size;
+	size.x = (width - ix * c_tileSize < c_tileSize) ? width - ix * c_tileSize : c_tileSize;
+	size.y = (height - iy * c_tileSize < c_tileSize) ? height - iy * c_tileSize : c_tileSize;
+	return size;
+}
+
+int f_count_translucent(const SurfaceData* sd, const iRect* r)
+{
+	int x, y, n = 0;
+	for (y=r.top; y<r.bottom; y++) {
+		const byte* p = sd.data + y * sd.stride + r.left * 4 + 3;
+		for (x=r.left; x<r.right; x++, p+=4)
+			if (*p != 255) n++;
+	}
+	return n;
+}
+
+bool f_is_uniform(const SurfaceData* sd, const iRect* r, uint32 colour)
+{
+	int x, y;
+	for (y=r.top; y<r.bottom; y++) {
+		const uint32* p = (const uint32*)(sd.data + y * sd.stride) + r.left;
+		for (x=r.left; x<r.right; x++)
+			if (*p++ != colour) return false;
+	}
+	return true;
+}
+
+void f_check_uniform(LayerCell* cell, const SurfaceData* sd, iPair extent)
+{
+	// whether the whole cell is the colour of its first pixel.
+	iRect all = { 0, 0, extent.x, extent.y };
+	cell.colour = *(const uint32*)sd.data;
+	cell.uniform = f_is_uniform(sd, &all, cell.colour);
+}
+
+void f_scan_cell(LayerCell* cell, const SurfaceData* sd, iPair extent)
+{
+	// count a cell from scratch; no pixels reads as transparent.
+	iRect all = { 0, 0, extent.x, extent.y };
+	if (!sd.data) {
+		cell.translucent = extent.x * extent.y;
+		cell.uniform = true;
+		cell.colour = 0;
+		return;
+	}
+	cell.translucent = f_count_translucent(sd, &all);
+	f_check_uniform(cell, sd, extent);
+}
+
+void f_tile_range(const fRect* clip, float size, int tilesX, int tilesY, iRect* range)
+{
+	// the range of tiles that overlap the clip (round out).
+	range.left = 0;
+	range.top = 0;
+	range.right = tilesX;
+	range.bottom = tilesY;
+	if (clip) {
+		range.left = (clip.left > 0) ? (int)(clip.left / size) : 0;
+		range.top = (clip.top > 0) ? (int)(clip.top / size) : 0;
+		range.right = (clip.right > 0) ? (int)(clip.right / size) + 1 : 0;
+		range.bottom = (clip.bottom > 0) ? (int)(clip.bottom / size) + 1 : 0;
+		if (range.right > tilesX) range.right = tilesX;
+		if (range.bottom > tilesY) range.bottom = tilesY;
+	}
+}
+
+void f_draw_cell(GfxDraw draw, GfxImage tile, const LayerCell* cell, iPair extent,
+				 float x, float y, int scale)
+{
+	// in the current blend mode; a uniform cell is a fill, and an
+	// empty one draws nothing.
+	if (!tile)
+		return;
+	if (cell.uniform) {
+		const byte* c = (const byte*)&cell.colour;
+		if (cell.colour) {
+			GfxDraw_fillColor(draw, c[0]/255.0f, c[1]/255.0f, c[2]/255.0f, c[3]/255.0f);
+			GfxDraw_fillRect(draw, x, y, (float)(extent.x << scale), (float)(extent.y << scale));
+		}
+	}
+	else {
+		// edge tiles can be smaller.
+		iPair tileSize = GfxImage_getSize(tile);
+		GfxDraw_drawImageRect(draw, tile, x, y,
+			(float)(tileSize.x << scale), (float)(tileSize.y << scale));
+	}
+}
+
 bool any_visible(ref Frame f)
 {
 	// is this frame or any subsequent sibling visible?
@@ -329,32 +482,32 @@ __inline float max04(float a, float b, float c)
 	return v;
 }
 
-// TODO: check if the tile is in the viewport; this is very worthwhile
-// to avoid selecting (and therefore swapping in) the textures
-// for tiles that will be clipped to the viewport anyway.
+// only tiles in the viewport are drawn, to avoid selecting (and
+// therefore swapping in) the textures for tiles that would be clipped
+// anyway; the clip is in the layer's space.
 
 void lf_draw_tiles(Layerref Frame f, FrameRenderRequest* r)
 {
 	GfxDraw draw = r.draw;
-	GfxImage* grid = f.grid;
 	int tilesX = f.tilesX, tilesY = f.tilesY;
-	float x = 0.0f, y= 0.0f;
-	float size = (float)c_tileSize;
+	iRect range;
+	float x, y;
+	float size = (float)(c_tileSize << f.scale);
 	int ix, iy;
 	assert(tilesX > 0 && tilesX < 1000); // TEST: corruption finding.
 	assert(tilesY > 0 && tilesY < 1000);
-	// render the grid of tiles.
-	for (iy=0; iy<tilesY; ++iy) {
-		for (ix=0; ix<tilesX; ++ix) {
-			GfxImage tile = grid[iy*tilesX+ix];
-			if (tile) {
-				// render the tile.
-				GfxDraw_drawImageRect(draw, tile, x, y, size, size);
-			}
+	f_tile_range(r.clip, size, tilesX, tilesY, &range);
+	// render the visible tiles.
+	y = range.top * size;
+	for (iy=range.top; iy<range.bottom; ++iy) {
+		x = range.left * size; // return to left edge.
+		for (ix=range.left; ix<range.right; ++ix) {
+			int index = iy*tilesX+ix;
+			f_draw_cell(draw, f.grid[index], &f.cells[index],
+				f_cell_extent(f.width, f.height, index), x, y, f.scale);
 			x += size; // advance one tile right.
 		}
 		y += size; // advance one tile down.
-		x = 0.0f; // return to left edge.
 	}
 }
 
@@ -389,6 +542,17 @@ void lf_draw(Layerref Frame f, FrameRenderRequest* r)
 	}
 }
 
+void lf_release_kept(Layerref Frame f)
+{
+	// the kept tiles no longer match the grid.
+	int i;
+	for (i=0; i<f.numKept; i++)
+		surface_destroy(&f.kept[i].pixels);
+	cpart_free(f.kept);
+	f.kept = 0;
+	f.numKept = f.maxKept = 0;
+}
+
 void lf_discard(Layerref Frame f)
 {
 	if (f.grid) {
@@ -398,10 +562,18 @@ void lf_discard(Layerref Frame f)
 		for (i=0; i<num; i++) {
 			if (f.grid[i])
 				release(f.grid[i]);
+			surface_destroy(&f.pixels[i]);
 		}
 		cpart_free(f.grid);
 		f.grid = 0;
+		cpart_free(f.pixels);
+		f.pixels = 0;
+		cpart_free(f.cells);
+		f.cells = 0;
+		cpart_free(f.touched);
+		f.touched = 0;
 	}
+	lf_release_kept(f);
 }
 
 int ceilPowerOfTwo(int value) {
@@ -425,9 +597,23 @@ GfxImage lf_createTile(Layerref Frame f, int width, int height)
 	return img;
 }
 
+void lf_scan_cell(Layerref Frame f, int index)
+{
+	f_scan_cell(&f.cells[index], &f.pixels[index], f_cell_extent(f.width, f.height, index));
+}
+
+void lf_changed(Layerref Frame f, int index)
+{
+	// let the canvas know its composites are out of date.
+	FrameTileChanged tc;
+	tc.layer = &f.frame;
+	tc.index = index;
+	frame_send_to_ancestors(&f.frame, frameTileChanged, &tc);
+}
+
 void lf_resize(Layerref Frame f, int width, int height)
 {
-	int tilesX, tilesY, ix, iy;
+	int tilesX, tilesY, i;
 	lf_discard(f); // destroy old grid of tiles.
 	f.width = width;
 	f.height = height;
@@ -436,42 +622,86 @@ void lf_resize(Layerref Frame f, int width, int height)
 	f.tilesX = tilesX;
 	f.tilesY = tilesY;
 	if (tilesX && tilesY) {
-		int wholeX, wholeY, partWidth, partHeight;
 		f.grid = cpart_alloc(tilesX * tilesY * sizeof(GfxImage));
 		if (!f.grid) return;
-		// create full tiles for wholly covered cells.
-		wholeX = (tilesX * c_tileSize == width) ? tilesX : (tilesX-1);
-		wholeY = (tilesY * c_tileSize == height) ? tilesY : (tilesY-1);
-		for (iy=0; iy<wholeY; iy++) {
-			for (ix=0; ix<wholeX; ix++) {
-				f.grid[iy * tilesX + ix] = lf_createTile(f, c_tileSize, c_tileSize);
-			}
-		}
-		// determine nearest powers of two for partial cells.
-		partWidth = ceilPowerOfTwo(width - (wholeX * c_tileSize));
-		partHeight = ceilPowerOfTwo(height - (wholeY * c_tileSize));
-		if (partWidth) {
-			// create partial tiles along the right edge.
-			int idx = tilesX - 1; // last tile in first row.
-			for (iy=0; iy<wholeY; iy++) {
-				f.grid[idx] = lf_createTile(f, partWidth, c_tileSize);
-				idx += tilesX; // same place in next row.
-			}
-		}
-		if (partHeight) {
-			// create partial tiles along the bottom edge.
-			int idx = tilesX * (tilesY - 1); // first tile in last row.
-			for (ix=0; ix<wholeX; ix++) {
-				f.grid[idx + ix] = lf_createTile(f, c_tileSize, partHeight);
-			}
-		}
-		if (partWidth && partHeight) {
-			// create the bottom right corner tile.
-			f.grid[tilesX * tilesY - 1] = lf_createTile(f, partWidth, partHeight);
-		}
+		memset(f.grid, 0, tilesX * tilesY * sizeof(GfxImage));
+		f.pixels = cpart_alloc(tilesX * tilesY * sizeof(SurfaceData));
+		memset(f.pixels, 0, tilesX * tilesY * sizeof(SurfaceData));
+		f.touched = cpart_alloc(tilesX * tilesY);
+		memset(f.touched, 0, tilesX * tilesY);
+		f.cells = cpart_alloc(tilesX * tilesY * sizeof(LayerCell));
+		for (i=0; i<tilesX * tilesY; i++)
+			lf_scan_cell(f, i);
+	}
+	lf_changed(f, -1);
+}
+
+iPair f_cell_size(int width, int height, int index)
+{
+	// whole tiles, with the nearest powers of two along the right and
+	// bottom edges for partly covered cells.
+	int tilesX = (width + (c_tileSize-1)) / c_tileSize;
+	int ix = index % tilesX, iy = index / tilesX;
+	iPair size;
+	size.x = (ix < width / c_tileSize) ? c_tileSize : ceilPowerOfTwo(width - ix * c_tileSize);
+	size.y = (iy < height / c_tileSize) ? c_tileSize : ceilPowerOfTwo(height - iy * c_tileSize);
+	return size;
+}
+
+iPair lf_cell_size(Layerref Frame f, int index)
+{
+	return f_cell_size(f.width, f.height, index);
+}
+
+SurfaceData lf_cell_pixels(Layerref Frame f, int index)
+{
+	// the cell's pixels, or the shared transparent ones; read only.
+	SurfaceData sd;
+	iPair size;
+	if (f.pixels[index].data)
+		return f.pixels[index];
+	if (!g_transparent)
+		g_transparent = calloc(c_tileSize * c_tileSize, 4);
+	size = lf_cell_size(f, index);
+	sd.format = surface_rgba8;
+	sd.width = size.x;
+	sd.height = size.y;
+	sd.stride = size.x * 4;
+	sd.data = g_transparent;
+	return sd;
+}
+
+void lf_realize(Layerref Frame f, int index)
+{
+	// give an empty cell a tile, transparent to start with.
+	if (!f.grid[index]) {
+		iPair size = lf_cell_size(f, index);
+		f.grid[index] = lf_createTile(f, size.x, size.y);
+		surface_create(&f.pixels[index], surface_rgba8, size.x, size.y);
+		memset(f.pixels[index].data, 0, f.pixels[index].stride * size.y);
 	}
 }
 
+void lf_empty(Layerref Frame f, int index)
+{
+	if (f.grid[index]) {
+		release(f.grid[index]);
+		f.grid[index] = 0;
+	}
+	surface_destroy(&f.pixels[index]);
+	lf_scan_cell(f, index);
+}
+
+bool f_is_clear(const SurfaceData* sd)
+{
+	// every byte zero: only then does an empty cell read the same.
+	const uint32* p = (const uint32*)sd.data;
+	size_t i, n = (sd.stride * sd.height) / 4;
+	for (i=0; i<n; i++)
+		if (p[i]) return false;
+	return true;
+}
+
 let MIN(a,b) = a < b ? a : b;
 
 void lf_load_surface(Layerref Frame f, SurfaceData* sd)
@@ -484,7 +714,10 @@ void lf_load_surface(Layerref Frame f, SurfaceData* sd)
 	tilesX = f.tilesX;
 	for (iy=0; iy<copyY; iy++) {
 		for (ix=0; ix<copyX; ix++) {
-			GfxImage tile = f.grid[iy * tilesX + ix];
+			int index = iy * tilesX + ix;
+			GfxImage tile;
+			lf_realize(f, index);
+			tile = f.grid[index];
 			if (tile) {
 				// select the tile of the source surface to copy.
 				int left = ix * c_tileSize, top = iy * c_tileSize;
@@ -495,44 +728,104 @@ void lf_load_surface(Layerref Frame f, SurfaceData* sd)
 					sd.stride,
 					sd.data + (top * sd.stride) + (left * sd.format)
 				};
-				// upload this data as a sub-image of the tile.
-				(*tile).update(tile, 0, 0, &src);
+				// copy into the tile's pixels, and upload those.
+				surface_copy(&f.pixels[index], 0, 0, &src);
+				(*tile).update(tile, 0, 0, &f.pixels[index]);
+				lf_scan_cell(f, index);
+				lf_changed(f, index);
 			}
 		}
 	}
 }
 
-// blend source image over destination image.
-void f_blend_image(GfxImage dest, const iRect* destRect,
+// blend source image into a tile's pixels, then upload the part that
+// changed to the tile's image.
+void f_blend_image(SurfaceData* pixels, GfxImage tile, const iRect* destRect,
 						  const FrameBlendImage* b) // ignores b.dest.
 {
-	SurfaceData sd = {0};
 	SurfaceReadRGBA16 src;
-	iPair size;
-
-	// create a buffer for blending.
-	// TODO: this should not be created in here each time!
-	size = GfxImage_getSize(dest);
-	assert(size.x > 0 && size.y > 0);
-	surface_create(&sd, surface_rgba8, size.x, size.y);
-
-	if(1)
-	{
-	// copy destination image to buffer.
-	GfxImage_read(dest, &sd);
+	SurfaceReadA16 cov;
+	BlendSource* reader;
+	SurfaceData dirty;
+	int left, top, right, bottom;
 
 	// init reader from 16-bit surface.
-	surface_read_rgba16(&src, b.image, b.alpha);
+	if (b.image.format == surface_a16) {
+		// coverage image, expanded to the colour as it is read.
+		surface_read_a16(&cov, b.image, b.col, b.alpha);
+		reader = &cov.r;
+	} else {
+		surface_read_rgba16(&src, b.image, b.alpha);
+		reader = &src.r;
+	}
 
 	// perform 16-bit blend op over 8-bit dest.
-	surface_blend_source(&sd, destRect.left, destRect.top,
-		&src.r, b.mode);
+	surface_blend_source(pixels, destRect.left, destRect.top,
+		reader, b.mode);
+
+	// upload the blended rect, clipped to the tile.
+	left = destRect.left > 0 ? destRect.left : 0;
+	top = destRect.top > 0 ? destRect.top : 0;
+	right = MIN(destRect.right, pixels.width);
+	bottom = MIN(destRect.bottom, pixels.height);
+	if (right > left && bottom > top) {
+		dirty = *pixels;
+		dirty.width = right - left;
+		dirty.height = bottom - top;
+		dirty.data = pixels.data + (top * pixels.stride) + (left * 4);
+		GfxImage_update(tile, left, top, &dirty);
+	}
+}
 
-	// upload buffer back to destination image.
-	GfxImage_update(dest, 0, 0, &sd);
+void lf_keep_tile(Layerref Frame f, int index)
+{
+	// copy the tile's pixels as they are.
+	SurfaceData* from = &f.pixels[index];
+	SurfaceData* to;
+	if (f.numKept == f.maxKept) {
+		f.maxKept = f.maxKept ? f.maxKept * 2 : 64;
+		f.kept = realloc(f.kept, f.maxKept * sizeof(FrameTile));
 	}
+	f.kept[f.numKept].index = index;
+	to = &f.kept[f.numKept].pixels;
+	surface_create(to, surface_rgba8, from.width, from.height);
+	memcpy(to.data, from.data, from.stride * from.height);
+	f.numKept++;
+}
 
-	surface_destroy(&sd);
+void lf_blend_cell(Layerref Frame f, int index, const iRect* dest,
+				   const FrameBlendImage* b)
+{
+	// blend, and count the rect blended into again.
+	LayerCell* cell = &f.cells[index];
+	SurfaceData* sd = &f.pixels[index];
+	iPair extent = f_cell_extent(f.width, f.height, index);
+	iRect area;
+	int before, translucent;
+	area.left = dest.left > 0 ? dest.left : 0;
+	area.top = dest.top > 0 ? dest.top : 0;
+	area.right = MIN(dest.right, extent.x);
+	area.bottom = MIN(dest.bottom, extent.y);
+	if (area.right <= area.left || area.bottom <= area.top) {
+		f_blend_image(sd, f.grid[index], dest, b);
+		return;
+	}
+	before = f_count_translucent(sd, &area);
+	f_blend_image(sd, f.grid[index], dest, b);
+	translucent = cell.translucent;
+	cell.translucent += f_count_translucent(sd, &area) - before;
+	if (area.right - area.left == extent.x && area.bottom - area.top == extent.y) {
+		// covers the cell, so it may have become uniform.
+		f_check_uniform(cell, sd, extent);
+	}
+	else if (cell.uniform) {
+		cell.uniform = f_is_uniform(sd, &area, cell.colour);
+	}
+	else if (translucent && !cell.translucent) {
+		// strokes blend a piece at a time, so a cell filled by them
+		// only shows up here, as it turns opaque.
+		f_check_uniform(cell, sd, extent);
+	}
 }
 
 // blend source image over all overlapping tiles.
@@ -552,17 +845,82 @@ void lf_blend_image(Layerref Frame f, const FrameBlendImage* b)
 	// iterate over tiles, blending to each one.
 	for (iy=top; iy<bottom; iy++) {
 		for (ix=left; ix<right; ix++) {
-			GfxImage tile = f.grid[iy * f.tilesX + ix];
+			int index = iy * f.tilesX + ix;
 			// translate the dest rect into tile space.
 			iRect dest = {
 				b.dest.left - ix * c_tileSize, b.dest.top - iy * c_tileSize,
 				b.dest.right - ix * c_tileSize, b.dest.bottom - iy * c_tileSize };
+			lf_realize(f, index);
+			if (f.keep && !f.touched[index]) {
+				lf_keep_tile(f, index);
+				f.touched[index] = 1;
+			}
 			// blend the source image to this tile.
-			f_blend_image(tile, &dest, b);
+			lf_blend_cell(f, index, &dest, b);
+			lf_changed(f, index);
 		}
 	}
 }
 
+void lf_take_tiles(Layerref Frame f, FrameTiles* t)
+{
+	// hand over the kept tiles, and keep each tile again on its next change.
+	int i;
+	for (i=0; i<f.numKept; i++) {
+		// the stroke may have left the tile clear, e.g. by erasing.
+		int index = f.kept[i].index;
+		if (f.grid[index] && f_is_clear(&f.pixels[index]))
+			lf_empty(f, index);
+		// or painted it over in one colour, which no single blend saw.
+		else if (f.grid[index] && !f.cells[index].uniform)
+			f_check_uniform(&f.cells[index], &f.pixels[index],
+				f_cell_extent(f.width, f.height, index));
+	}
+	t.tiles = f.kept;
+	t.count = f.numKept;
+	f.kept = 0;
+	f.numKept = f.maxKept = 0;
+	if (f.touched)
+		memset(f.touched, 0, f.tilesX * f.tilesY);
+}
+
+void lf_get_tiles(Layerref Frame f, FrameTiles* t)
+{
+	// the pixels of the tile at each index, which stay the layer's and
+	// are read only; no pixels if out of range.
+	int i, num = f.tilesX * f.tilesY;
+	SurfaceData none = {0};
+	for (i=0; i<t.count; i++) {
+		int index = t.tiles[i].index;
+		t.tiles[i].pixels = (index >= 0 && index < num) ? lf_cell_pixels(f, index) : none;
+	}
+}
+
+void lf_update_tiles(Layerref Frame f, FrameTiles* t)
+{
+	// replace the pixels of each tile with a copy of these, and upload.
+	int i, num = f.tilesX * f.tilesY;
+	for (i=0; i<t.count; i++) {
+		int index = t.tiles[i].index;
+		SurfaceData* sd = &t.tiles[i].pixels;
+		iPair size;
+		if (index < 0 || index >= num)
+			continue;
+		size = lf_cell_size(f, index);
+		if (sd.width != size.x || sd.height != size.y)
+			continue;
+		if (f_is_clear(sd)) {
+			lf_empty(f, index);
+		} else {
+			lf_realize(f, index);
+			surface_copy(&f.pixels[index], 0, 0, sd);
+			GfxImage_update(f.grid[index], 0, 0, &f.pixels[index]);
+			lf_scan_cell(f, index);
+		}
+		lf_changed(f, index);
+	}
+}
+
 int lf_message(ref Frame frame, FrameMessage msg, void* data)
 {
 	Layerref Frame f = (Layerref Frame)frame;
@@ -585,6 +943,9 @@ int lf_message(ref Frame frame, FrameMessage msg, void* data)
 	case frameReleaseResources:
 		lf_discard(f);
 		break;
+	case frameParentChanged:
+		lf_changed(f, -1);
+		break;
 	case frameSetSize:
 		{iPair* size = data;
 		lf_resize(f, size.x, size.y);
@@ -602,6 +963,22 @@ int lf_message(ref Frame frame, FrameMessage msg, void* data)
 	case frameSetRenderContext:
 		f.rc = data;
 		break;
+	case frameSetScale:
+		f.scale = *(int*)data;
+		break;
+	case frameKeepTiles:
+		f.keep = *(bool*)data;
+		if (!f.keep) lf_release_kept(f);
+		break;
+	case frameTakeTiles:
+		lf_take_tiles(f, data);
+		break;
+	case frameGetTiles:
+		lf_get_tiles(f, data);
+		break;
+	case frameUpdateTiles:
+		lf_update_tiles(f, data);
+		break;
 	}
 	return 0;
 }
@@ -616,7 +993,12 @@ export ref Frame frame_create_layer(ref Frame parent)
 	frame.x = frame.y = 0;
 	frame.width = frame.height = 0;
 	frame.tilesX = frame.tilesY = 0;
+	frame.scale = 0;
 	frame.show = true;
+	frame.keep = false;
+	frame.touched = 0;
+	frame.kept = 0;
+	frame.numKept = frame.maxKept = 0;
 	frame_insert((ref Frame)frame, parent, -1); // append.
 	return (ref Frame)frame;
 }
@@ -624,6 +1006,30 @@ export ref Frame frame_create_layer(ref Frame parent)
 
 // canvas frame.
 
+// while a layer is being painted, the layers below it and the layers
+// above it are each flattened into a grid of tiles, so a redraw draws
+// three sets of tiles however many layers there are. layers are drawn
+// pre-multiplied, and "over" is associative for pre-multiplied colour,
+// so each composite can be drawn over the paper just as its layers
+// were. the tiles are flattened from the layers' own pixels as they
+// come into view, and again after a layer reports a change to one.
+
+// whether or not a layer is active, nothing under an opaque cell of a
+// fully visible layer is drawn or flattened.
+
+struct CanvasCache {
+	GfxImage* grid;		// per tile; 0 where no layer has pixels.
+	SurfaceData* pixels;
+	LayerCell* cells;
+	byte* dirty;		// per tile: to flatten again before drawing.
+};
+
+struct CanvasLayerState {
+	ref Frame layer;
+	float alpha;
+	bool show;
+};
+
 struct CanvasFrame {
 	Frame frame;
 	Affine2D transform;
@@ -631,11 +1037,281 @@ struct CanvasFrame {
 	RGBA col; // paper colour.
 	//RGBA bgcol; // outside paper.
 	bool show;
+	ref Frame active; // the layer being painted, if any.
+	ref Frame overlay; // e.g. a stroke preview, owned by whoever set it.
+	int tilesX, tilesY; // of the composites, allocated if non-zero.
+	CanvasCache below, above;
+	CanvasLayerState* stack; // the layers the composites were made from.
+	int numStack, maxStack;
 };
 
+void canvas_free_cache(CanvasCache* c, int num)
+{
+	int i;
+	if (c.grid) {
+		for (i=0; i<num; i++) {
+			if (c.grid[i])
+				release(c.grid[i]);
+			surface_destroy(&c.pixels[i]);
+		}
+	}
+	cpart_free(c.grid);
+	cpart_free(c.pixels);
+	cpart_free(c.cells);
+	cpart_free(c.dirty);
+	c.grid = 0;
+	c.pixels = 0;
+	c.cells = 0;
+	c.dirty = 0;
+}
+
+void canvas_discard(Canvasref Frame f)
+{
+	int num = f.tilesX * f.tilesY;
+	canvas_free_cache(&f.below, num);
+	canvas_free_cache(&f.above, num);
+	f.tilesX = f.tilesY = 0;
+	cpart_free(f.stack);
+	f.stack = 0;
+	f.numStack = f.maxStack = 0;
+}
+
+void canvas_invalidate(Canvasref Frame f)
+{
+	int num = f.tilesX * f.tilesY;
+	if (num) {
+		memset(f.below.dirty, 1, num);
+		memset(f.above.dirty, 1, num);
+	}
+}
+
+void canvas_alloc_cache(CanvasCache* c, int num)
+{
+	c.grid = cpart_alloc(num * sizeof(GfxImage));
+	memset(c.grid, 0, num * sizeof(GfxImage));
+	c.pixels = cpart_alloc(num * sizeof(SurfaceData));
+	memset(c.pixels, 0, num * sizeof(SurfaceData));
+	c.cells = cpart_alloc(num * sizeof(LayerCell));
+	c.dirty = cpart_alloc(num);
+	memset(c.dirty, 1, num);
+}
+
+bool canvas_plain_layers(Canvasref Frame f)
+{
+	// the canvas can draw its layers tile by tile, if every layer is a
+	// plain pre-multiplied layer the size of the canvas.
+	ref Frame walk;
+	int n = 0;
+	bool same = true;
+	if (f.width <= 0 || f.height <= 0)
+		return false;
+	for (walk = f.frame.children; walk; walk = walk.next) {
+		Layerref Frame l;
+		if (walk.message != lf_message)
+			return false;
+		l = (Layerref Frame)walk;
+		if (l.mode != gfxBlendPremultiplied || l.scale || !l.cells ||
+			l.width != f.width || l.height != f.height)
+			return false;
+		// only the active layer draws its children.
+		if (walk.children && walk != f.active)
+			return false;
+		// compare with the layers the composites were made from.
+		if (n == f.maxStack) {
+			f.maxStack = f.maxStack ? f.maxStack * 2 : 16;
+			f.stack = realloc(f.stack, f.maxStack * sizeof(CanvasLayerState));
+		}
+		if (n >= f.numStack || f.stack[n].layer != walk ||
+			f.stack[n].alpha != l.alpha || f.stack[n].show != l.show) {
+			f.stack[n].layer = walk;
+			f.stack[n].alpha = l.alpha;
+			f.stack[n].show = l.show;
+			same = false;
+		}
+		n++;
+	}
+	if (n != f.numStack)
+		same = false;
+	f.numStack = n;
+	if (!same)
+		canvas_invalidate(f);
+	return true;
+}
+
+bool canvas_cache_ready(Canvasref Frame f)
+{
+	// the composites stand in for the layers around the active one.
+	if (!f.active || !canvas_plain_layers(f))
+		return false;
+	if (!f.tilesX) {
+		f.tilesX = (f.width + (c_tileSize-1)) / c_tileSize;
+		f.tilesY = (f.height + (c_tileSize-1)) / c_tileSize;
+		canvas_alloc_cache(&f.below, f.tilesX * f.tilesY);
+		canvas_alloc_cache(&f.above, f.tilesX * f.tilesY);
+	}
+	return true;
+}
+
+bool lf_covers(Layerref Frame l, int index)
+{
+	// nothing drawn before this cell shows through it.
+	return l.show && l.alpha >= 1.0f && !l.cells[index].translucent &&
+		l.mode == gfxBlendPremultiplied;
+}
+
+ref Frame canvas_first_seen(ref Frame from, ref Frame to, int index)
+{
+	// the lowest layer of [from, to) that is not covered by another.
+	ref Frame walk, first = from;
+	for (walk = from; walk && walk != to; walk = walk.next)
+		if (lf_covers((Layerref Frame)walk, index))
+			first = walk;
+	return first;
+}
+
+void f_over_pre(SurfaceData* sd, const SurfaceData* src, int alpha)
+{
+	// pre-multiplied source over pre-multiplied dest, scaled by
+	// alpha (0-256); the surfaces are the same size.
+	byte* d = sd.data;
+	const byte* s = src.data;
+	size_t n = (size_t)sd.width * sd.height;
+	while (n--) {
+		int a = (s[3] * alpha) >> 8, ia = 255 - a;
+		if (a == 255) {
+			d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; d[3] = 255;
+		}
+		else if (s[3]) {
+			d[0] = (byte)(((s[0] * alpha) >> 8) + (d[0] * ia + 127) / 255);
+			d[1] = (byte)(((s[1] * alpha) >> 8) + (d[1] * ia + 127) / 255);
+			d[2] = (byte)(((s[2] * alpha) >> 8) + (d[2] * ia + 127) / 255);
+			d[3] = (byte)(a + (d[3] * ia + 127) / 255);
+		}
+		d += 4;
+		s += 4;
+	}
+}
+
+void canvas_flatten(Canvasref Frame f, CanvasCache* c, int index, bool above)
+{
+	// flatten the visible layers on one side of the active layer.
+	Layerref Frame active = (Layerref Frame)f.active;
+	SurfaceData* sd = &c.pixels[index];
+	iPair size = f_cell_size(f.width, f.height, index);
+	ref Frame walk = above ? f.active.next : f.frame.children;
+	bool any = false;
+	walk = canvas_first_seen(walk, f.active, index);
+	c.dirty[index] = 0;
+	if (!sd.data)
+		surface_create(sd, surface_rgba8, size.x, size.y);
+	memset(sd.data, 0, sd.stride * sd.height);
+	for (; walk && walk != f.active; walk = walk.next) {
+		Layerref Frame l = (Layerref Frame)walk;
+		if (l.show && l.alpha > 0 && l.pixels && l.pixels[index].data) {
+			f_over_pre(sd, &l.pixels[index], (int)(l.alpha * 256));
+			any = true;
+		}
+	}
+	if (any) {
+		if (!c.grid[index])
+			c.grid[index] = lf_createTile(active, size.x, size.y);
+		GfxImage_update(c.grid[index], 0, 0, sd);
+	}
+	else {
+		// nothing to draw here.
+		if (c.grid[index]) {
+			release(c.grid[index]);
+			c.grid[index] = 0;
+		}
+		surface_destroy(sd);
+	}
+	f_scan_cell(&c.cells[index], sd, f_cell_extent(f.width, f.height, index));
+}
+
+void canvas_draw_cache(Canvasref Frame f, CanvasCache* c, bool above, FrameRenderRequest* r)
+{
+	// as lf_draw_tiles, flattening tiles that are out of date first.
+	GfxDraw draw = r.draw;
+	float size = (float)c_tileSize;
+	iRect range;
+	int ix, iy;
+	f_tile_range(r.clip, size, f.tilesX, f.tilesY, &range);
+	GfxDraw_blendMode(draw, gfxBlendPremultiplied, 1.0f);
+	for (iy=range.top; iy<range.bottom; ++iy) {
+		for (ix=range.left; ix<range.right; ++ix) {
+			int index = iy * f.tilesX + ix;
+			if (!above) {
+				// skip what the active layer or the layers above cover.
+				if (f.above.dirty[index])
+					canvas_flatten(f, &f.above, index, true);
+				if (!f.above.cells[index].translucent ||
+					lf_covers((Layerref Frame)f.active, index))
+					continue;
+			}
+			if (c.dirty[index])
+				canvas_flatten(f, c, index, above);
+			f_draw_cell(draw, c.grid[index], &c.cells[index],
+				f_cell_extent(f.width, f.height, index), ix * size, iy * size, 0);
+		}
+	}
+}
+
+void canvas_draw_layers(Canvasref Frame f, FrameRenderRequest* r)
+{
+	// tile by tile, starting from the lowest layer that shows.
+	GfxDraw draw = r.draw;
+	float size = (float)c_tileSize;
+	int tilesX = (f.width + (c_tileSize-1)) / c_tileSize;
+	int tilesY = (f.height + (c_tileSize-1)) / c_tileSize;
+	iRect range;
+	int ix, iy;
+	f_tile_range(r.clip, size, tilesX, tilesY, &range);
+	for (iy=range.top; iy<range.bottom; ++iy) {
+		for (ix=range.left; ix<range.right; ++ix) {
+			int index = iy * tilesX + ix;
+			iPair extent = f_cell_extent(f.width, f.height, index);
+			ref Frame walk = canvas_first_seen(f.frame.children, 0, index);
+			for (; walk; walk = walk.next) {
+				Layerref Frame l = (Layerref Frame)walk;
+				if (l.show) {
+					GfxDraw_blendMode(draw, l.mode, l.alpha);
+					f_draw_cell(draw, l.grid[index], &l.cells[index], extent,
+						ix * size, iy * size, 0);
+				}
+			}
+		}
+	}
+}
+
 void canvas_draw(Canvasref Frame f, FrameRenderRequest* r)
 {
 	GfxDraw draw = r.draw;
+	FrameRenderRequest req;
+	fRect clip;
+	float pt[8];
+	int i;
+
+	// the layers see the clip in canvas space: the bounds of its
+	// corners through the inverse of the canvas transform.
+	req.draw = r.draw;
+	req.clip = r.clip;
+	req.alpha = r.alpha;
+	if (r.clip) {
+		pt[0] = r.clip.left;  pt[1] = r.clip.top;
+		pt[2] = r.clip.right; pt[3] = r.clip.top;
+		pt[4] = r.clip.left;  pt[5] = r.clip.bottom;
+		pt[6] = r.clip.right; pt[7] = r.clip.bottom;
+		affine_transform_inv(&f.transform, pt, pt, 4);
+		clip.left = clip.right = pt[0];
+		clip.top = clip.bottom = pt[1];
+		for (i=2; i<8; i+=2) {
+			if (pt[i] < clip.left) clip.left = pt[i];
+			if (pt[i] > clip.right) clip.right = pt[i];
+			if (pt[i+1] < clip.top) clip.top = pt[i+1];
+			if (pt[i+1] > clip.bottom) clip.bottom = pt[i+1];
+		}
+		req.clip = &clip;
+	}
 
 	GfxDraw_blendMode(draw, gfxBlendCopy, 1);
 
@@ -650,7 +1326,24 @@ void canvas_draw(Canvasref Frame f, FrameRenderRequest* r)
 	GfxDraw_fillRect(draw, 0, 0, (float)f.width, (float)f.height);
 
 	// render the canvas layers.
-	frame_send_to_children(&f.frame, frameRender, r);
+	if (canvas_cache_ready(f)) {
+		canvas_draw_cache(f, &f.below, false, &req);
+		f.active.message(f.active, frameRender, &req);
+		if (f.overlay)
+			f.overlay.message(f.overlay, frameRender, &req);
+		canvas_draw_cache(f, &f.above, true, &req);
+	}
+	else if (!f.overlay && canvas_plain_layers(f))
+		canvas_draw_layers(f, &req);
+	else {
+		// in order, with the overlay just above the active layer.
+		ref Frame walk;
+		for (walk = f.frame.children; walk; walk = walk.next) {
+			walk.message(walk, frameRender, &req);
+			if (walk == f.active && f.overlay)
+				f.overlay.message(f.overlay, frameRender, &req);
+		}
+	}
 
 	// restore transform and other state.
 	GfxDraw_restore(draw);
@@ -673,6 +1366,7 @@ int canvas_message(ref Frame frame, FrameMessage msg, void* data)
 	case frameSetSize:
 		{iPair* size = data;
 		f.width = size.x; f.height = size.y;
+		canvas_discard(f);
 		break;}
 	case frameGetSize:
 		((iPair*)data).x = f.width;
@@ -684,6 +1378,28 @@ int canvas_message(ref Frame frame, FrameMessage msg, void* data)
 	case frameGetAffine:
 		*(Affine2D*)data = f.transform;
 		break;
+	case frameSetActive:
+		f.active = data;
+		canvas_invalidate(f);
+		break;
+	case frameSetOverlay:
+		f.overlay = data;
+		break;
+	case frameTileChanged:
+		{FrameTileChanged* tc = data;
+		if (tc.layer.parent != &f.frame)
+			return 0;
+		// the active layer is drawn as it is.
+		if (tc.layer != f.active && f.tilesX) {
+			if (tc.index < 0)
+				canvas_invalidate(f);
+			else
+				f.below.dirty[tc.index] = f.above.dirty[tc.index] = 1;
+		}
+		return 1;}
+	case frameReleaseResources:
+		canvas_discard(f);
+		break;
 	}
 	return 0;
 }
@@ -696,6 +1412,13 @@ export ref Frame frame_create_canvas(ref Frame parent)
 	frame.col = rgba_white;
 	//frame.bgcol = rgba_grey;
 	frame.show = true;
+	frame.active = frame.overlay = 0;
+	// no composites until a layer is active.
+	frame.tilesX = frame.tilesY = 0;
+	memset(&frame.below, 0, sizeof(CanvasCache));
+	memset(&frame.above, 0, sizeof(CanvasCache));
+	frame.stack = 0;
+	frame.numStack = frame.maxStack = 0;
 	frame_insert((ref Frame)frame, parent, -1); // append.
 	return (ref Frame)frame;
 }
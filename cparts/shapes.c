@@ -2,6 +2,7 @@
 #include "shapes.h"
 #include "blend.h"
 #include "surface.h"
+#include "simd.h"
 
 
 // edge generators.
@@ -36,6 +37,33 @@ void shape_circle_fill(int radius, shape_span_func span, void* data)
 	}
 }
 
+void shape_circle_rows(int radius, int* half)
+{
+	// same walk as shape_circle_fill, recording each row once.
+	int f = 1 - radius;
+	int x = radius;
+	int y = 0;
+
+	half[0] = radius;
+
+	while (x > y)
+	{
+		if (f >= 0)
+		{
+			if (x-1 != y)   // avoid overlap
+				half[x] = y;
+
+			x--;
+			f -= x+x;    // -2x + 2
+		}
+
+		y++;
+		f += y+y+1;  // 1 + 2y (first value is 3)
+
+		half[y] = x;
+	}
+}
+
 
 // span renderers.
 
@@ -91,23 +119,107 @@ void shape_circle_fill_rgba(SurfaceData* sd, int cx, int cy, int radius, RGBA co
 	shape_circle_fill(radius, shape_span_fill_rgba, &args);
 }
 
+// -1 until the first circle is drawn, then the cpu_supports_sse2 result.
+static int s_useSSE2 = -1;
+
 void shape_circle_fill_rgba16(SurfaceData* sd, int cx, int cy, int radius, RGBA16 colour)
 {
-	ShapeSpanFillRGBA16 args;
+	int rowBuf[512]; // row tables up to this radius live on the stack.
+	int* half = rowBuf;
+	byte* center;
+	int stride, y;
 	assert(sd->format == surface_rgba16);
-	// adjust sd so it is centered on the circle center.
-	args.data = sd->data + cy * sd->stride + cx * 8;
-	args.stride = (int)sd->stride;
-	// choose span renderer based on colour alpha.
-	if (colour.a < 65535) {
-		args.fill = span8_col_over;
-		args.col = colour;
-	} else {
-		args.fill = span8_col_copy;
-		args.col = colour;
+	assert(radius >= 0);
+	// walk the circle edge once up front, so the fill loops below
+	// have no per-span indirect calls.
+	if (radius >= (int)(sizeof(rowBuf)/sizeof(int)))
+		half = cpart_alloc((radius + 1) * sizeof(int));
+	shape_circle_rows(radius, half);
+	if (s_useSSE2 < 0)
+		s_useSSE2 = cpu_supports_sse2();
+	stride = (int)sd->stride;
+	if (cx - radius < 0 || cy - radius < 0 ||
+		cx + radius >= sd->width || cy + radius >= sd->height)
+	{
+		// clip each row to the surface; large dabs always land here,
+		// since they span several accumulator tiles.
+		void (*span)(RGBA16* dst, int len, RGBA16 col);
+		if (colour.a < 65535)
+			span = s_useSSE2 ? span8_col_over_sse2 : span8_col_over;
+		else
+			span = s_useSSE2 ? span8_col_copy_sse2 : span8_col_copy;
+		for (y=-radius; y<=radius; y++) {
+			int row = cy + y, w = half[y < 0 ? -y : y];
+			int left = cx - w, right = cx + w + 1;
+			if (row < 0 || row >= sd->height) continue;
+			if (left < 0) left = 0;
+			if (right > sd->width) right = sd->width;
+			if (left < right)
+				span((RGBA16*)(sd->data + row * sd->stride) + left, right - left, colour);
+		}
 	}
-	// render the circle.
-	shape_circle_fill(radius, shape_span_fill_rgba16, &args);
+	else
+	{
+		// adjust sd so it is centered on the circle center.
+		center = sd->data + cy * sd->stride + cx * 8;
+		// choose span renderer based on colour alpha.
+		if (colour.a < 65535) {
+			if (s_useSSE2) {
+				circle8_col_over_sse2(center, stride, half, radius, colour);
+			} else {
+				span8_col_over((RGBA16*)center - half[0], half[0]+half[0]+1, colour);
+				for (y=1; y<=radius; y++) {
+					int w = half[y];
+					span8_col_over((RGBA16*)(center - y*stride) - w, w+w+1, colour);
+					span8_col_over((RGBA16*)(center + y*stride) - w, w+w+1, colour);
+				}
+			}
+		} else {
+			if (s_useSSE2) {
+				circle8_col_copy_sse2(center, stride, half, radius, colour);
+			} else {
+				span8_col_copy((RGBA16*)center - half[0], half[0]+half[0]+1, colour);
+				for (y=1; y<=radius; y++) {
+					int w = half[y];
+					span8_col_copy((RGBA16*)(center - y*stride) - w, w+w+1, colour);
+					span8_col_copy((RGBA16*)(center + y*stride) - w, w+w+1, colour);
+				}
+			}
+		}
+	}
+	if (half != rowBuf)
+		cpart_free(half);
+}
+
+void shape_circle_fill_a16(SurfaceData* sd, int cx, int cy, int radius, int a)
+{
+	int rowBuf[512];
+	int* half = rowBuf;
+	int y;
+	void (*span)(uint16* dst, int len, int a);
+	assert(sd->format == surface_a16);
+	if (s_useSSE2 < 0)
+		s_useSSE2 = cpu_supports_sse2();
+	if (a < 65535)
+		span = s_useSSE2 ? span2_col_over_sse2 : span2_col_over;
+	else
+		span = span2_col_copy;
+	assert(radius >= 0);
+	if (radius >= (int)(sizeof(rowBuf)/sizeof(int)))
+		half = cpart_alloc((radius + 1) * sizeof(int));
+	shape_circle_rows(radius, half);
+	// clip each row to the surface.
+	for (y=-radius; y<=radius; y++) {
+		int row = cy + y, w = half[y < 0 ? -y : y];
+		int left = cx - w, right = cx + w + 1;
+		if (row < 0 || row >= sd->height) continue;
+		if (left < 0) left = 0;
+		if (right > sd->width) right = sd->width;
+		if (left < right)
+			span((uint16*)(sd->data + row * sd->stride) + left, right - left, a);
+	}
+	if (half != rowBuf)
+		cpart_free(half);
 }
 
 // Draw an anti-aliased line up to 1 pixel in width.
@@ -13,6 +13,10 @@ typedef void (*shape_span_func)(void* data, int x, int y, int n);
 
 void shape_circle_fill(int radius, shape_span_func span, void* data);
 
+// fill half[0..radius] with the half-width of rows +/-y of a circle;
+// row y spans [-half[y], half[y]], matching shape_circle_fill.
+void shape_circle_rows(int radius, int* half);
+
 // line
 // arc
 
@@ -28,7 +32,10 @@ void shape_span_fill_rgba(void* data, int x, int y, int n);
 // render API.
 
 void shape_circle_fill_rgba(struct SurfaceData* sd, int cx, int cy, int radius, RGBA colour);
+// clips to the surface.
 void shape_circle_fill_rgba16(struct SurfaceData* sd, int cx, int cy, int radius, RGBA16 colour);
+// coverage only, a in [0,65535]; clips to the surface.
+void shape_circle_fill_a16(struct SurfaceData* sd, int cx, int cy, int radius, int a);
 
 
 #endif
@@ -1,7 +1,10 @@
 #include "defs.h"
 #include "KNI.h"
+#include "blend.h"
+#include "simd.h"
 
 #include <windows.h> // EXCEPTION_EXECUTE_HANDLER
+#include <emmintrin.h> // SSE2 intrinsics
 
 int cpu_supports_simd()
 {
@@ -39,5 +42,349 @@ no_support:
 	return has_support;
 }
 
+int cpu_supports_sse2()
+{
+	int has_support = 0;
+
+	// SSE2 uses the same XMM state, so the OS check for SSE covers it.
+	if (cpu_supports_simd()) {
+		_asm {
+			mov eax, 1
+			cpuid
+			test edx, (1<<26)
+			jz no_support		// -> no SSE2 support
+
+			mov has_support, 1	// success!
+		}
+	}
+no_support:
+
+	return has_support;
+}
+
 // __declspec(align(16)) float array[ARRAY_SIZE];
 // (float*) _aligned_malloc(ARRAY_SIZE * sizeof(float), 16);
+
+
+// RGBA16 colour spans.
+
+// RGBA16 pixels are 8 bytes, so each XMM register holds two pixels.
+// The main loops handle four pixels per iteration, then mop up the
+// remaining pair and single pixel with 64-bit loads and stores.
+// Spans are not assumed to be 16-byte aligned (movdqu throughout.)
+
+static __inline __m128i col16_pair(RGBA16 col)
+{
+	return _mm_set_epi16((short)col.a, (short)col.b, (short)col.g, (short)col.r,
+						 (short)col.a, (short)col.b, (short)col.g, (short)col.r);
+}
+
+static __inline void span8_copy_x(RGBA16* dst, int len, __m128i c)
+{
+	while (len >= 4) {
+		_mm_storeu_si128((__m128i*)dst, c);
+		_mm_storeu_si128((__m128i*)(dst+2), c);
+		dst += 4; len -= 4;
+	}
+	if (len >= 2) {
+		_mm_storeu_si128((__m128i*)dst, c);
+		dst += 2; len -= 2;
+	}
+	if (len) {
+		_mm_storel_epi64((__m128i*)dst, c);
+	}
+}
+
+// C' = B' + (1-b)A' as in OVER16_P, where k holds 65536-b.
+// PMULHUW gives exactly U16MUL_A1(k, A) and PADDW wraps the same
+// way the scalar code does when it stores into a uint16.
+static __inline void span8_over_x(RGBA16* dst, int len, __m128i c, __m128i k)
+{
+	while (len >= 4) {
+		__m128i d0 = _mm_loadu_si128((__m128i*)dst);
+		__m128i d1 = _mm_loadu_si128((__m128i*)(dst+2));
+		d0 = _mm_add_epi16(c, _mm_mulhi_epu16(d0, k));
+		d1 = _mm_add_epi16(c, _mm_mulhi_epu16(d1, k));
+		_mm_storeu_si128((__m128i*)dst, d0);
+		_mm_storeu_si128((__m128i*)(dst+2), d1);
+		dst += 4; len -= 4;
+	}
+	if (len >= 2) {
+		__m128i d0 = _mm_loadu_si128((__m128i*)dst);
+		d0 = _mm_add_epi16(c, _mm_mulhi_epu16(d0, k));
+		_mm_storeu_si128((__m128i*)dst, d0);
+		dst += 2; len -= 2;
+	}
+	if (len) {
+		__m128i d0 = _mm_loadl_epi64((__m128i*)dst);
+		d0 = _mm_add_epi16(c, _mm_mulhi_epu16(d0, k));
+		_mm_storel_epi64((__m128i*)dst, d0);
+	}
+}
+
+// with b=0 the multiplier 65536 does not fit in a word;
+// (65536*A)>>16 is just A, so the blend becomes a plain add.
+static __inline void span8_add_x(RGBA16* dst, int len, __m128i c)
+{
+	while (len >= 2) {
+		__m128i d0 = _mm_loadu_si128((__m128i*)dst);
+		_mm_storeu_si128((__m128i*)dst, _mm_add_epi16(c, d0));
+		dst += 2; len -= 2;
+	}
+	if (len) {
+		__m128i d0 = _mm_loadl_epi64((__m128i*)dst);
+		_mm_storel_epi64((__m128i*)dst, _mm_add_epi16(c, d0));
+	}
+}
+
+void span8_col_copy_sse2(RGBA16* dst, int len, RGBA16 col)
+{
+	span8_copy_x(dst, len, col16_pair(col));
+}
+
+void span8_col_over_sse2(RGBA16* dst, int len, RGBA16 col)
+{
+	__m128i c = col16_pair(col);
+	if (col.a) {
+		__m128i k = _mm_set1_epi16((short)(65536 - col.a));
+		span8_over_x(dst, len, c, k);
+	}
+	else span8_add_x(dst, len, c);
+}
+
+
+// RGBA16 circles.
+
+// the row table comes from shape_circle_rows; each row is filled
+// exactly once, so the result matches shape_circle_fill spans.
+
+void circle8_col_copy_sse2(byte* center, int stride, const int* half, int radius, RGBA16 col)
+{
+	__m128i c = col16_pair(col);
+	byte* below = center;
+	byte* above = center;
+	int y, w;
+	span8_copy_x((RGBA16*)center - half[0], half[0]+half[0]+1, c);
+	for (y=1; y<=radius; y++) {
+		below += stride; above -= stride;
+		w = half[y];
+		span8_copy_x((RGBA16*)above - w, w+w+1, c);
+		span8_copy_x((RGBA16*)below - w, w+w+1, c);
+	}
+}
+
+void circle8_col_over_sse2(byte* center, int stride, const int* half, int radius, RGBA16 col)
+{
+	__m128i c = col16_pair(col);
+	byte* below = center;
+	byte* above = center;
+	int y, w;
+	if (col.a) {
+		__m128i k = _mm_set1_epi16((short)(65536 - col.a));
+		span8_over_x((RGBA16*)center - half[0], half[0]+half[0]+1, c, k);
+		for (y=1; y<=radius; y++) {
+			below += stride; above -= stride;
+			w = half[y];
+			span8_over_x((RGBA16*)above - w, w+w+1, c, k);
+			span8_over_x((RGBA16*)below - w, w+w+1, c, k);
+		}
+	}
+	else {
+		span8_add_x((RGBA16*)center - half[0], half[0]+half[0]+1, c);
+		for (y=1; y<=radius; y++) {
+			below += stride; above -= stride;
+			w = half[y];
+			span8_add_x((RGBA16*)above - w, w+w+1, c);
+			span8_add_x((RGBA16*)below - w, w+w+1, c);
+		}
+	}
+}
+
+
+// RGBA16 coverage masks.
+
+// four pixels per step: widen four coverage bytes to words k=cov*257
+// (PUNPCKLBW with itself), broadcast each to its pixel's four channels,
+// scale the colour by k, then blend as OVERSAT16_P does in blend.c.
+static __inline void mask8_over_x4(RGBA16* dst, int cov4, __m128i c)
+{
+	__m128i k = _mm_cvtsi32_si128(cov4);
+	__m128i s0, s1, a0, a1, d0, d1;
+	k = _mm_unpacklo_epi8(k, k);		// k0 k1 k2 k3 (words)
+	k = _mm_unpacklo_epi16(k, k);		// k0 k0 k1 k1 k2 k2 k3 k3
+	s0 = _mm_mulhi_epu16(c, _mm_unpacklo_epi32(k, k)); // pixels 0,1
+	s1 = _mm_mulhi_epu16(c, _mm_unpackhi_epi32(k, k)); // pixels 2,3
+	// broadcast the scaled alpha of each pixel to all four channels.
+	a0 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s0, 0xFF), 0xFF);
+	a1 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s1, 0xFF), 0xFF);
+	d0 = _mm_loadu_si128((__m128i*)dst);
+	d1 = _mm_loadu_si128((__m128i*)(dst+2));
+	d0 = _mm_adds_epu16(s0, _mm_sub_epi16(d0, _mm_mulhi_epu16(d0, a0)));
+	d1 = _mm_adds_epu16(s1, _mm_sub_epi16(d1, _mm_mulhi_epu16(d1, a1)));
+	_mm_storeu_si128((__m128i*)dst, d0);
+	_mm_storeu_si128((__m128i*)(dst+2), d1);
+}
+
+void span8_mask_over_sse2(RGBA16* dst, int len, const byte* cov, RGBA16 col)
+{
+	__m128i c = col16_pair(col);
+	int cov4;
+	while (len >= 4) {
+		memcpy(&cov4, cov, 4);
+		// mask corners and edges are mostly empty.
+		if (cov4) mask8_over_x4(dst, cov4, c);
+		dst += 4; cov += 4; len -= 4;
+	}
+	if (len) {
+		// blend the last 1-3 pixels via a padded copy.
+		RGBA16 tail[4];
+		cov4 = 0;
+		memcpy(tail, dst, len * sizeof(RGBA16));
+		memcpy(&cov4, cov, len);
+		mask8_over_x4(tail, cov4, c);
+		memcpy(dst, tail, len * sizeof(RGBA16));
+	}
+}
+
+
+// A16 coverage.
+
+// the alpha channel of the RGBA16 kernels, eight pixels per step;
+// the last 1-7 pixels go through the scalar spans in blend.c.
+
+void span2_col_over_sse2(uint16* dst, int len, int a)
+{
+	// a over dst is a + dst*(65536-a)>>16; with a=0 it is dst.
+	__m128i c = _mm_set1_epi16((short)a);
+	__m128i k = _mm_set1_epi16((short)(65536 - a));
+	if (!a)
+		return;
+	while (len >= 8) {
+		__m128i d = _mm_loadu_si128((__m128i*)dst);
+		_mm_storeu_si128((__m128i*)dst, _mm_add_epi16(c, _mm_mulhi_epu16(d, k)));
+		dst += 8; len -= 8;
+	}
+	span2_col_over(dst, len, a);
+}
+
+void span2_mask_over_sse2(uint16* dst, int len, const byte* cov, int a)
+{
+	// widen coverage to k=cov*257, scale a by it, then blend as
+	// OVERSAT16_P does.
+	__m128i va = _mm_set1_epi16((short)a);
+	int cov8[2];
+	while (len >= 8) {
+		memcpy(cov8, cov, 8);
+		// mask corners and edges are mostly empty.
+		if (cov8[0] | cov8[1]) {
+			__m128i k = _mm_loadl_epi64((__m128i*)cov);
+			__m128i b, d;
+			k = _mm_unpacklo_epi8(k, k);
+			b = _mm_mulhi_epu16(k, va);
+			d = _mm_loadu_si128((__m128i*)dst);
+			d = _mm_adds_epu16(b, _mm_sub_epi16(d, _mm_mulhi_epu16(d, b)));
+			_mm_storeu_si128((__m128i*)dst, d);
+		}
+		dst += 8; cov += 8; len -= 8;
+	}
+	span2_mask_over(dst, len, cov, a);
+}
+
+
+// A8 spans.
+
+// widen to words: a*(256-f) + b*f is at most 65280, so PMULLW and
+// PADDW cannot overflow and the result matches span_a8_lerp exactly.
+void span_a8_lerp_sse2(byte* dst, const byte* a, const byte* b, int len, int f)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i wf = _mm_set1_epi16((short)f);
+	__m128i wg = _mm_set1_epi16((short)(256 - f));
+	while (len >= 16) {
+		__m128i va = _mm_loadu_si128((__m128i*)a);
+		__m128i vb = _mm_loadu_si128((__m128i*)b);
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wg),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wf));
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wg),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wf));
+		lo = _mm_srli_epi16(lo, 8);
+		hi = _mm_srli_epi16(hi, 8);
+		_mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(lo, hi));
+		dst += 16; a += 16; b += 16; len -= 16;
+	}
+	while (len--) {
+		*dst++ = (byte)((*a++ * (256 - f) + *b++ * f) >> 8);
+	}
+}
+
+
+// 16-bit upsampling.
+
+// a - mulhi(a,f<<8) + mulhi(b,f<<8) is LERP16 in blend.c exactly; f is
+// at most 255, so the weight fits in an unsigned word.
+static __inline __m128i lerp16_x(__m128i a, __m128i b, __m128i w)
+{
+	return _mm_add_epi16(_mm_sub_epi16(a, _mm_mulhi_epu16(a, w)), _mm_mulhi_epu16(b, w));
+}
+
+void span2_lerp_sse2(uint16* dst, const uint16* a, const uint16* b, int len, int f)
+{
+	__m128i w = _mm_set1_epi16((short)(f << 8));
+	while (len >= 8) {
+		__m128i va = _mm_loadu_si128((__m128i*)a);
+		__m128i vb = _mm_loadu_si128((__m128i*)b);
+		_mm_storeu_si128((__m128i*)dst, lerp16_x(va, vb, w));
+		dst += 8; a += 8; b += 8; len -= 8;
+	}
+	if (len)
+		span2_lerp(dst, a, b, len, f);
+}
+
+// RGBA16 writes two output pixels per step and A16 writes eight, each
+// with its own weight; smaller expansions use the scalar span.
+void span2_expand_sse2(uint16* dst, const uint16* src, int len, int channels, int shift)
+{
+	__m128i w[128];
+	int n = 1 << shift, step = 256 >> shift, per, i, k;
+
+	per = (channels == 4) ? 2 : 8;
+	if ((channels != 4 && channels != 1) || n < per) {
+		span2_expand(dst, src, len, channels, shift);
+		return;
+	}
+
+	// weights for each group of outputs from one source pixel.
+	for (k=0; k<n; k+=per) {
+		if (channels == 4)
+			w[k/per] = _mm_set_epi16(
+				(short)((k+1)*step << 8), (short)((k+1)*step << 8),
+				(short)((k+1)*step << 8), (short)((k+1)*step << 8),
+				(short)(k*step << 8), (short)(k*step << 8),
+				(short)(k*step << 8), (short)(k*step << 8));
+		else
+			w[k/per] = _mm_set_epi16(
+				(short)((k+7)*step << 8), (short)((k+6)*step << 8),
+				(short)((k+5)*step << 8), (short)((k+4)*step << 8),
+				(short)((k+3)*step << 8), (short)((k+2)*step << 8),
+				(short)((k+1)*step << 8), (short)(k*step << 8));
+	}
+
+	for (i=0; i<len; i++, src += channels) {
+		__m128i a, b;
+		if (channels == 4) {
+			a = _mm_loadl_epi64((__m128i*)src);
+			b = _mm_loadl_epi64((__m128i*)(src+4));
+			a = _mm_unpacklo_epi64(a, a);
+			b = _mm_unpacklo_epi64(b, b);
+		} else {
+			a = _mm_set1_epi16((short)src[0]);
+			b = _mm_set1_epi16((short)src[1]);
+		}
+		for (k=0; k<n/per; k++) {
+			_mm_storeu_si128((__m128i*)dst, lerp16_x(a, b, w[k]));
+			dst += 8;
+		}
+	}
+}
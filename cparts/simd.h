@@ -2,5 +2,33 @@
 #define CPART_SIMD
 
 int cpu_supports_simd();
+int cpu_supports_sse2();
+
+
+// SSE2 kernels.
+// Only call these when cpu_supports_sse2() returns true.
+// Output is bit-identical to the scalar span8 functions in blend.c.
+
+void span8_col_copy_sse2(RGBA16* dst, int len, RGBA16 col);
+void span8_col_over_sse2(RGBA16* dst, int len, RGBA16 col);
+
+// fill a circle from a row table (see shape_circle_rows)
+// center: address of the center pixel; half[y]: half-width of rows +/-y.
+void circle8_col_copy_sse2(byte* center, int stride, const int* half, int radius, RGBA16 col);
+void circle8_col_over_sse2(byte* center, int stride, const int* half, int radius, RGBA16 col);
+
+// pre-multiplied colour scaled by 8-bit coverage, over the span.
+void span8_mask_over_sse2(RGBA16* dst, int len, const byte* cov, RGBA16 col);
+
+// coverage only: the alpha channel of the above (see span2 in blend.c).
+void span2_col_over_sse2(uint16* dst, int len, int a);
+void span2_mask_over_sse2(uint16* dst, int len, const byte* cov, int a);
+
+// linear blend of two alpha spans, f in [0,255] towards b.
+void span_a8_lerp_sse2(byte* dst, const byte* a, const byte* b, int len, int f);
+
+// 16-bit spans for upsampling (see span2_lerp and span2_expand).
+void span2_lerp_sse2(uint16* dst, const uint16* a, const uint16* b, int len, int f);
+void span2_expand_sse2(uint16* dst, const uint16* src, int len, int channels, int shift);
 
 #endif
@@ -0,0 +1,62 @@
+#include "defs.h"
+#include "thread.h"
+#include "spscring.h"
+
+// head and tail are free-running counters; each is written by one
+// side only, and they live on separate cache lines so the producer
+// and consumer do not contend for the same line.
+
+#define SPSCRING_LINE 64
+
+struct SpscRing {
+	volatile unsigned head;		// next slot to write; producer only.
+	byte pad1[SPSCRING_LINE - sizeof(unsigned)];
+	volatile unsigned tail;		// next slot to read; consumer only.
+	byte pad2[SPSCRING_LINE - sizeof(unsigned)];
+	unsigned mask;
+	int itemSize;
+	byte* data;
+};
+
+SpscRing* spscring_create(int itemSize, int capacity)
+{
+	SpscRing* r = cpart_new(SpscRing);
+	unsigned size = 1;
+	while (size < (unsigned)capacity) size <<= 1;
+	r->mask = size - 1;
+	r->itemSize = itemSize;
+	r->data = cpart_alloc(size * itemSize);
+	return r;
+}
+
+void spscring_destroy(SpscRing* r)
+{
+	cpart_free(r->data);
+	cpart_free(r);
+}
+
+bool spscring_push(SpscRing* r, const void* item)
+{
+	unsigned head = r->head;
+	if (head - r->tail > r->mask)
+		return false; // full.
+	memcpy(r->data + (head & r->mask) * r->itemSize, item, r->itemSize);
+	// the item must be visible before the new head.
+	thread_fence();
+	r->head = head + 1;
+	return true;
+}
+
+bool spscring_pop(SpscRing* r, void* item)
+{
+	unsigned tail = r->tail;
+	if (tail == r->head)
+		return false; // empty.
+	// read the item only after seeing the head that published it.
+	thread_fence();
+	memcpy(item, r->data + (tail & r->mask) * r->itemSize, r->itemSize);
+	// finish reading before the slot is handed back.
+	thread_fence();
+	r->tail = tail + 1;
+	return true;
+}
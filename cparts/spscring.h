@@ -0,0 +1,24 @@
+#ifndef CPART_SPSCRING
+#define CPART_SPSCRING
+
+
+// Single-producer single-consumer ring.
+
+// A lock-free queue of fixed-size items between exactly two threads.
+// Only the producer may push and only the consumer may pop; neither
+// side ever blocks, so a full or empty ring is reported to the caller.
+
+typedef struct SpscRing SpscRing;
+
+// capacity is rounded up to a power of two.
+SpscRing* spscring_create(int itemSize, int capacity);
+void spscring_destroy(SpscRing* r);
+
+// producer: copy item into the ring; false if the ring is full.
+bool spscring_push(SpscRing* r, const void* item);
+
+// consumer: copy the oldest item out; false if the ring is empty.
+bool spscring_pop(SpscRing* r, void* item);
+
+
+#endif
@@ -54,6 +54,14 @@ void surface_fill_rect_nc(SurfaceData* sd, RGBA colour, int x, int y, int width,
 			to += adv;
 		}
 	}
+	else if (sd->format == surface_a16)
+	{
+		int a = colour.a * 257;
+		while (height--) {
+			span2_col_copy((uint16*)to, width, a);
+			to += adv;
+		}
+	}
 }
 
 void surface_fill(SurfaceData* sd, RGBA colour)
@@ -208,6 +216,47 @@ void surface_read_rgba16(SurfaceReadRGBA16* state, const SurfaceData* sd, int al
 }
 
 
+// SurfaceReadA16.
+
+static void surface_begin_a16(BlendSource* self, int x, int y, int width, int height) {
+	SurfaceReadA16* state = (SurfaceReadA16*)self;
+	state->row = state->sd->data + y * state->sd->stride + x * 2;
+	state->iter = (uint16*)state->row;
+}
+
+static void surface_next_a16(BlendSource* self) {
+	SurfaceReadA16* state = (SurfaceReadA16*)self;
+	state->row += state->sd->stride;
+	state->iter = (uint16*)state->row;
+}
+
+static void surface_read8_a16(BlendSource* self, BlendBuffer* data) {
+}
+
+static void surface_read1_a16(BlendSource* self, RGBA16* col) {
+	// expand coverage to the pre-multiplied colour, matching the
+	// colour an rgba16 accumulator would hold: c * k / 255.
+	SurfaceReadA16* state = (SurfaceReadA16*)self;
+	uint_fast32_t k = *state->iter++;
+	col->r = (uint16)(k * state->col.r / 255);
+	col->g = (uint16)(k * state->col.g / 255);
+	col->b = (uint16)(k * state->col.b / 255);
+	col->a = (uint16)k;
+}
+
+void surface_read_a16(SurfaceReadA16* state, const SurfaceData* sd, RGBA col, int alpha) {
+	state->r.begin = surface_begin_a16;
+	state->r.next = surface_next_a16;
+	state->r.read8 = surface_read8_a16;
+	state->r.read1 = surface_read1_a16;
+	state->r.width = sd->width;
+	state->r.height = sd->height;
+	state->sd = sd;
+	state->col = col;
+	state->alpha = alpha;
+}
+
+
 // API.
 
 void surface_blend_source(SurfaceData* sd, int x, int y, BlendSource* src, BlendMode mode)
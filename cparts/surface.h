@@ -75,6 +75,22 @@ typedef struct SurfaceReadRGBA16 {
 void surface_read_rgba16(SurfaceReadRGBA16* state, const SurfaceData* sd, int alpha);
 
 
+// SurfaceReadA16.
+
+// a16 coverage expanded to a single colour as it is read.
+
+typedef struct SurfaceReadA16 {
+	BlendSource r;
+	uint16* iter; // current read pos.
+	int alpha; // [0,255]
+	byte* row; // current row in sd.
+	const SurfaceData* sd;
+	RGBA col; // not pre-multiplied.
+} SurfaceReadA16;
+
+void surface_read_a16(SurfaceReadA16* state, const SurfaceData* sd, RGBA col, int alpha);
+
+
 // Blend API.
 
 void surface_blend_source(SurfaceData* sd, int x, int y, BlendSource* src, BlendMode mode);
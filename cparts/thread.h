@@ -0,0 +1,45 @@
+#ifndef CPART_THREAD
+#define CPART_THREAD
+
+
+// Threads.
+
+typedef struct Thread Thread;
+typedef unsigned long (*thread_func)(void* data);
+
+// start a thread running func(data).
+Thread* thread_create(thread_func func, void* data);
+
+// wait for the thread to exit, then free it.
+void thread_join(Thread* t);
+
+// true once the thread has exited; does not wait.
+bool thread_finished(Thread* t);
+
+// give up the rest of the time slice.
+void thread_yield(void);
+
+// full memory barrier: no load or store moves across it.
+void thread_fence(void);
+
+// atomically add v to *p; returns the new value.
+int thread_atomic_add(volatile int* p, int v);
+
+// number of processors available.
+int thread_cpu_count(void);
+
+
+// Signals.
+
+// auto-reset wakeup: a raise with no waiter wakes the next wait,
+// so a raise between checking for work and waiting is not lost.
+
+typedef struct ThreadSignal ThreadSignal;
+
+ThreadSignal* thread_signal_create(void);
+void thread_signal_destroy(ThreadSignal* s);
+void thread_signal_raise(ThreadSignal* s);
+void thread_signal_wait(ThreadSignal* s);
+
+
+#endif
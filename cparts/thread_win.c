@@ -0,0 +1,93 @@
+#include "defs.h"
+#include "thread.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+
+struct Thread {
+	HANDLE handle;
+	thread_func func;
+	void* data;
+};
+
+static DWORD WINAPI thread_start(LPVOID param)
+{
+	Thread* t = param;
+	return t->func(t->data);
+}
+
+Thread* thread_create(thread_func func, void* data)
+{
+	Thread* t = cpart_new(Thread);
+	t->func = func;
+	t->data = data;
+	t->handle = CreateThread(NULL, 0, thread_start, t, 0, NULL);
+	if (!t->handle) {
+		cpart_free(t);
+		return 0;
+	}
+	return t;
+}
+
+void thread_join(Thread* t)
+{
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+	cpart_free(t);
+}
+
+bool thread_finished(Thread* t)
+{
+	return WaitForSingleObject(t->handle, 0) == WAIT_OBJECT_0;
+}
+
+void thread_yield(void)
+{
+	SwitchToThread();
+}
+
+void thread_fence(void)
+{
+	MemoryBarrier();
+}
+
+int thread_atomic_add(volatile int* p, int v)
+{
+	return InterlockedExchangeAdd((volatile LONG*)p, v) + v;
+}
+
+int thread_cpu_count(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+
+struct ThreadSignal {
+	HANDLE event;
+};
+
+ThreadSignal* thread_signal_create(void)
+{
+	ThreadSignal* s = cpart_new(ThreadSignal);
+	s->event = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset.
+	return s;
+}
+
+void thread_signal_destroy(ThreadSignal* s)
+{
+	CloseHandle(s->event);
+	cpart_free(s);
+}
+
+void thread_signal_raise(ThreadSignal* s)
+{
+	SetEvent(s->event);
+}
+
+void thread_signal_wait(ThreadSignal* s)
+{
+	WaitForSingleObject(s->event, INFINITE);
+}
@@ -0,0 +1,160 @@
+#include "defs.h"
+#include "surface.h"
+#include "tileaccum.h"
+
+#include <limits.h>
+
+// Tiles in use are found through a small chained hash on their tile
+// coords; a stroke only covers a handful at a time. Every tile in use
+// is also on the active list, so a flush does not scan the buckets.
+
+#define TILEACCUM_BUCKETS 64
+
+struct TileAccum {
+	int format;
+	int count;			// tiles in use.
+	AccumTile* active;	// tiles in use.
+	AccumTile* free;	// clear tiles for reuse.
+	AccumTile* buckets[TILEACCUM_BUCKETS];
+};
+
+static const RGBA c_transparent = {0};
+
+#define TILEACCUM_HASH(TX,TY) \
+	(((unsigned)(TX) * 73856093u ^ (unsigned)(TY) * 19349663u) & (TILEACCUM_BUCKETS-1))
+
+TileAccum* tileaccum_create(int format)
+{
+	TileAccum* ta = cpart_new(TileAccum);
+	ta->format = format;
+	return ta;
+}
+
+static void tileaccum_free_list(AccumTile* t)
+{
+	while (t) {
+		AccumTile* link = t->link;
+		surface_destroy(&t->sd);
+		cpart_free(t);
+		t = link;
+	}
+}
+
+void tileaccum_destroy(TileAccum* ta)
+{
+	tileaccum_free_list(ta->active);
+	tileaccum_free_list(ta->free);
+	cpart_free(ta);
+}
+
+AccumTile* tileaccum_get(TileAccum* ta, int tx, int ty)
+{
+	AccumTile* t = ta->buckets[TILEACCUM_HASH(tx, ty)];
+	while (t && (t->tx != tx || t->ty != ty))
+		t = t->next;
+	return t;
+}
+
+AccumTile* tileaccum_tile(TileAccum* ta, int tx, int ty)
+{
+	AccumTile* t = tileaccum_get(ta, tx, ty);
+	if (!t) {
+		unsigned h = TILEACCUM_HASH(tx, ty);
+		if (ta->free) {
+			// reuse a tile; released tiles are always clear.
+			t = ta->free;
+			ta->free = t->link;
+		} else {
+			t = cpart_new(AccumTile);
+			surface_create(&t->sd, ta->format, ACCUM_TILE_SIZE, ACCUM_TILE_SIZE);
+			surface_fill(&t->sd, c_transparent);
+		}
+		t->tx = tx; t->ty = ty;
+		t->dirty.left = t->dirty.top = INT_MAX;
+		t->dirty.right = t->dirty.bottom = INT_MIN;
+		t->next = ta->buckets[h];
+		ta->buckets[h] = t;
+		t->link = ta->active;
+		ta->active = t;
+		ta->count++;
+	}
+	return t;
+}
+
+int tileaccum_count(TileAccum* ta)
+{
+	return ta->count;
+}
+
+int tileaccum_missing(TileAccum* ta, const iRect* r)
+{
+	int left = r->left >> ACCUM_TILE_BITS, top = r->top >> ACCUM_TILE_BITS;
+	int right = (r->right - 1) >> ACCUM_TILE_BITS;
+	int bottom = (r->bottom - 1) >> ACCUM_TILE_BITS;
+	int tx, ty, missing = 0;
+	for (ty=top; ty<=bottom; ty++)
+		for (tx=left; tx<=right; tx++)
+			if (!tileaccum_get(ta, tx, ty)) missing++;
+	return missing;
+}
+
+void accumtile_touch(AccumTile* t, int left, int top, int right, int bottom)
+{
+	if (left < 0) left = 0;
+	if (top < 0) top = 0;
+	if (right > ACCUM_TILE_SIZE) right = ACCUM_TILE_SIZE;
+	if (bottom > ACCUM_TILE_SIZE) bottom = ACCUM_TILE_SIZE;
+	if (left < t->dirty.left) t->dirty.left = left;
+	if (top < t->dirty.top) t->dirty.top = top;
+	if (right > t->dirty.right) t->dirty.right = right;
+	if (bottom > t->dirty.bottom) t->dirty.bottom = bottom;
+}
+
+int tileaccum_format(TileAccum* ta)
+{
+	return ta->format;
+}
+
+void tileaccum_output(TileAccum* ta, TileAccumOutput func, void* data)
+{
+	AccumTile* t;
+	for (t = ta->active; t; t = t->link) {
+		iRect d = t->dirty;
+		if (d.left < d.right && d.top < d.bottom) {
+			// view of the dirty area within the tile.
+			SurfaceData view = t->sd;
+			iRect bounds;
+			view.width = d.right - d.left;
+			view.height = d.bottom - d.top;
+			view.data += d.top * view.stride + d.left * surfaceBytesPerPixel(view.format);
+			bounds.left = (t->tx << ACCUM_TILE_BITS) + d.left;
+			bounds.top = (t->ty << ACCUM_TILE_BITS) + d.top;
+			bounds.right = bounds.left + view.width;
+			bounds.bottom = bounds.top + view.height;
+			func(data, &view, bounds);
+		}
+	}
+}
+
+void tileaccum_flush(TileAccum* ta, TileAccumOutput func, void* data)
+{
+	AccumTile* t;
+	if (func)
+		tileaccum_output(ta, func, data);
+	t = ta->active;
+	while (t) {
+		AccumTile* link = t->link;
+		iRect d = t->dirty;
+		if (d.left < d.right && d.top < d.bottom) {
+			// only the dirty area needs to be cleared.
+			surface_fill_rect_nc(&t->sd, c_transparent, d.left, d.top,
+				d.right - d.left, d.bottom - d.top);
+		}
+		t->link = ta->free;
+		ta->free = t;
+		t = link;
+	}
+	ta->active = 0;
+	ta->count = 0;
+	cpart_zero(ta->buckets, sizeof(ta->buckets));
+}
@@ -0,0 +1,60 @@
+#ifndef CPART_TILEACCUM
+#define CPART_TILEACCUM
+
+
+// Tiled accumulator.
+
+// A sparse plane of small surfaces that deferred paint is accumulated
+// into. Tiles are allocated as the stroke moves over them and each one
+// tracks its own dirty rect, so a flush only blends and clears pixels
+// that were actually painted. Released tiles are kept for reuse.
+
+#define ACCUM_TILE_BITS 6
+#define ACCUM_TILE_SIZE (1 << ACCUM_TILE_BITS)
+
+typedef struct AccumTile AccumTile;
+struct AccumTile {
+	int tx, ty;			// tile coords, pixels >> ACCUM_TILE_BITS.
+	iRect dirty;		// pixels within the tile, empty when clean.
+	SurfaceData sd;		// ACCUM_TILE_SIZE square.
+	AccumTile* next;	// hash chain.
+	AccumTile* link;	// active or free list.
+};
+
+typedef struct TileAccum TileAccum;
+
+// receives the dirty part of a tile; bounds are in pixels and the
+// same size as the image.
+typedef void (*TileAccumOutput)(void* data, SurfaceData* image, iRect bounds);
+
+TileAccum* tileaccum_create(int format);
+void tileaccum_destroy(TileAccum* ta);
+
+// find the tile at (tx,ty), allocating a clear tile if required.
+AccumTile* tileaccum_tile(TileAccum* ta, int tx, int ty);
+
+// find the tile at (tx,ty), or 0; does not modify ta, so threads may
+// share lookups while no tiles are being allocated.
+AccumTile* tileaccum_get(TileAccum* ta, int tx, int ty);
+
+// number of tiles in use.
+int tileaccum_count(TileAccum* ta);
+
+int tileaccum_format(TileAccum* ta);
+
+// number of tiles that would be allocated to cover the pixel rect.
+int tileaccum_missing(TileAccum* ta, const iRect* r);
+
+// extend the tile's dirty rect, clipped to the tile (tile pixels).
+void accumtile_touch(AccumTile* t, int left, int top, int right, int bottom);
+
+// pass each dirty area to func; the tiles are not modified, so this
+// may run on another thread while nothing paints into ta.
+void tileaccum_output(TileAccum* ta, TileAccumOutput func, void* data);
+
+// pass each dirty area to func (if not 0), clear it, and release
+// all tiles.
+void tileaccum_flush(TileAccum* ta, TileAccumOutput func, void* data);
+
+
+#endif
@@ -0,0 +1,108 @@
+#include "defs.h"
+#include "thread.h"
+#include "workpool.h"
+
+// Indices are claimed with an atomic counter, so uneven items balance
+// themselves. A run only returns after every worker has left it, so a
+// late worker can never claim an index from the next run.
+
+typedef struct PoolWorker {
+	WorkPool* pool;
+	int id;
+	Thread* thread;
+	ThreadSignal* start;
+} PoolWorker;
+
+struct WorkPool {
+	int numWorkers;			// threads, not counting the caller.
+	PoolWorker* workers;
+	workpool_func func;
+	void* data;
+	int count;
+	volatile int next;		// next index to claim.
+	volatile int left;		// workers still in the current run.
+	volatile int quit;
+};
+
+static void workpool_work(WorkPool* wp, int id)
+{
+	for (;;) {
+		int index = thread_atomic_add(&wp->next, 1) - 1;
+		if (index >= wp->count) break;
+		wp->func(wp->data, index, id);
+	}
+}
+
+static unsigned long workpool_thread(void* data)
+{
+	PoolWorker* w = data;
+	WorkPool* wp = w->pool;
+	for (;;) {
+		thread_signal_wait(w->start);
+		if (wp->quit) break;
+		workpool_work(wp, w->id);
+		thread_atomic_add(&wp->left, -1);
+	}
+	return 0;
+}
+
+WorkPool* workpool_create(int threads)
+{
+	WorkPool* wp = cpart_new(WorkPool);
+	int i;
+	if (threads < 0) threads = 0;
+	wp->workers = threads ? cpart_alloc(threads * sizeof(PoolWorker)) : 0;
+	for (i=0; i<threads; i++) {
+		PoolWorker* w = &wp->workers[i];
+		w->pool = wp;
+		w->id = i + 1;
+		w->start = thread_signal_create();
+		w->thread = thread_create(workpool_thread, w);
+		if (!w->thread) {
+			thread_signal_destroy(w->start);
+			break;
+		}
+	}
+	wp->numWorkers = i;
+	return wp;
+}
+
+void workpool_destroy(WorkPool* wp)
+{
+	int i;
+	wp->quit = 1;
+	thread_fence();
+	for (i=0; i<wp->numWorkers; i++)
+		thread_signal_raise(wp->workers[i].start);
+	for (i=0; i<wp->numWorkers; i++) {
+		thread_join(wp->workers[i].thread);
+		thread_signal_destroy(wp->workers[i].start);
+	}
+	cpart_free(wp->workers);
+	cpart_free(wp);
+}
+
+int workpool_size(WorkPool* wp)
+{
+	return wp->numWorkers + 1;
+}
+
+void workpool_run(WorkPool* wp, int count, workpool_func func, void* data)
+{
+	int i, wake;
+	if (count <= 0) return;
+	wp->func = func;
+	wp->data = data;
+	wp->count = count;
+	wp->next = 0;
+	// no point waking more workers than there are items.
+	wake = (count - 1 < wp->numWorkers) ? count - 1 : wp->numWorkers;
+	wp->left = wake;
+	thread_fence();
+	for (i=0; i<wake; i++)
+		thread_signal_raise(wp->workers[i].start);
+	workpool_work(wp, 0);
+	while (wp->left)
+		thread_yield();
+	thread_fence();
+}
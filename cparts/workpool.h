@@ -0,0 +1,26 @@
+#ifndef CPART_WORKPOOL
+#define CPART_WORKPOOL
+
+
+// Work pool.
+
+// A fixed set of threads for fork-join loops: workpool_run hands out
+// indices [0,count) to the pool and the calling thread, and returns
+// once every index is done. The worker number passed to func is in
+// [0, workpool_size) and is unique among concurrent calls, so it can
+// select per-thread scratch state; the calling thread is worker 0.
+
+typedef struct WorkPool WorkPool;
+typedef void (*workpool_func)(void* data, int index, int worker);
+
+// threads: extra threads to start; 0 runs everything on the caller.
+WorkPool* workpool_create(int threads);
+void workpool_destroy(WorkPool* wp);
+
+// number of workers, including the calling thread.
+int workpool_size(WorkPool* wp);
+
+void workpool_run(WorkPool* wp, int count, workpool_func func, void* data);
+
+
+#endif
@@ -65,8 +65,8 @@ end
 -- key handler
 
 keyBind = {}
-keyBind[string.byte('Z')] = undo
-keyBind[string.byte('Y')] = redo
+keyBind[string.byte('Z')] = function() undo() refreshLayers() end
+keyBind[string.byte('Y')] = function() redo() refreshLayers() end
 keyBind[187] = zoomIn   -- '+'
 keyBind[189] = zoomOut  -- '-'
 keyBind[48] = zoomHome  -- '0'
@@ -351,26 +351,31 @@ end
 -- set_brush: mode, sizeMin, sizeMax, spacingPercent, minAlpha, maxAlpha, R,G,B
 
 function selectPencil()
-    -- fill one pixel (actually 3x3 circle) 4 times per pixel.
-    -- vary transparency to simulate a size less than one.
+    -- half-pixel dabs 4 times per pixel; sub-pixel dabs are
+    -- anti-aliased, and transparency varies with pressure.
     -- alpha 0.015 is 3/255, 0.15 is 38/255.
 	set_brush("normal", 0.5, 0.5, 0.25, 0.015, 0.15, 0.5, 0.5, 1)
+	set_smoothing(false)
 end
 
 function selectBrush()
 	-- varies from near-transparent to solid as size increases.
 	set_brush("normal", 10, 20, 1, 0.015, 0.5, 0.5, 0.7, 0.2)
+	set_smoothing(false)
 end
 
 function selectInk()
 	-- 0.25 alpha at 0.25 spacing means 100% after 4 dabs.
 	-- intended to give an anti-aliased edge.
 	set_brush("normal", 4, 12, 0.25, 0.25, 0.25, 0, 0, 0)
+	-- curves through the pen samples, for clean lines.
+	set_smoothing(true)
 end
 
 function selectEraser()
 	-- subtract 100% alpha and colour (hard edge)
 	set_brush("subtract", 4, 30, 1, 1, 1, 1, 1, 1)
+	set_smoothing(false)
 end
 
 
@@ -0,0 +1,252 @@
+#include "defs.h"
+#include "surface.h"
+#include "tablet_input.h"  // for Tablet_InputEvent protocol.
+#include "graphics.h"
+#include "skunkpad.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <math.h>
+
+// Brush engine benchmark: a console program that paints synthetic
+// strokes, then any stroke logs named on the command line, through a
+// DabPainter into a software rgba8 document, with no window, worker or
+// GPU involved. Links painter.c and strokelog.c with the cparts they
+// use: shapes, blend, simd, surface, dabmask, brushstamp, tileaccum,
+// workpool, thread_win and alloc.
+
+// usage: bench [stroke.log ...]
+
+static const int c_docSize = 2048;
+static const int c_strokeEvents = 1000;	// ~1s of 1kHz tablet input.
+static const int c_batchEvents = 8;		// events per tablet packet.
+
+typedef enum BenchShape {
+	shapeLine,		// diagonal, full pressure.
+	shapeRamp,		// zig-zag, pressure ramps from 0 to 1.
+	shapeSpiral,	// outward from the centre, pressure oscillates.
+	shapeJitter,	// random walk in short steps.
+	numShapes
+} BenchShape;
+
+static const char* const shapeNames[] = { "line", "ramp", "spiral", "jitter" };
+static const int brushSizes[] = { 4, 16, 64, 256 };	// pixels.
+static const int spacings[] = { 10, 25 };			// percent of size.
+
+typedef struct BenchDoc {
+	SurfaceData sd;		// rgba8 document.
+	int64 bytes;		// document bytes blended.
+	int merges;
+	BlendMode mode;		// of the stroke being merged.
+} BenchDoc;
+
+static double bench_seconds()
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+static void bench_output(void* obj, SurfaceData* image, RGBA col, iPair org, iRect bounds)
+{
+	// blend the way frames.c does, but into one big surface.
+	BenchDoc* doc = obj;
+	SurfaceData src = *image;
+	SurfaceReadRGBA16 rgba;
+	SurfaceReadA16 cov;
+	BlendSource* reader;
+	src.data += org.y * src.stride + org.x * surfaceBytesPerPixel(image->format);
+	src.width = bounds.right - bounds.left;
+	src.height = bounds.bottom - bounds.top;
+	if (image->format == surface_a16) {
+		surface_read_a16(&cov, &src, col, 255);
+		reader = &cov.r;
+	} else {
+		surface_read_rgba16(&rgba, &src, 255);
+		reader = &rgba.r;
+	}
+	surface_blend_source(&doc->sd, bounds.left, bounds.top, reader, doc->mode);
+	doc->bytes += (int64)src.width * src.height * 4;
+	doc->merges++;
+}
+
+static unsigned int bench_random(unsigned int* seed)
+{
+	// LCG, so every run paints the same strokes.
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+static void bench_make_stroke(BenchShape shape, Tablet_InputEvent* events, int count)
+{
+	unsigned int seed = 12345;
+	double x = c_docSize / 2, y = c_docSize / 2;
+	double margin = c_docSize / 8, span = c_docSize - 2 * margin;
+	int i;
+	for (i=0; i<count; i++) {
+		Tablet_InputEvent* e = &events[i];
+		double t = (double)i / (count - 1);
+		e->event = tablet_event_input;
+		e->pressure = 1;
+		switch (shape) {
+		case shapeLine:
+			x = margin + t * span;
+			y = margin + t * span;
+			break;
+		case shapeRamp:
+			x = margin + fmod(t * 4, 1.0) * span;
+			y = margin + t * span;
+			e->pressure = t;
+			break;
+		case shapeSpiral:
+			x = c_docSize / 2 + cos(t * 40) * t * span / 2;
+			y = c_docSize / 2 + sin(t * 40) * t * span / 2;
+			e->pressure = 0.5 + 0.5 * sin(t * 100);
+			break;
+		default:
+			x += (int)(bench_random(&seed) % 9) - 4;
+			y += (int)(bench_random(&seed) % 9) - 4;
+			e->pressure = 0.25 + (bench_random(&seed) % 256) / 512.0;
+			break;
+		}
+		e->x = x;
+		e->y = y;
+		e->tilt = 0;
+		e->rotation = 0;
+		e->buttons = 1;
+	}
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+	double p = *(const double*)a, q = *(const double*)b;
+	return p < q ? -1 : p > q;
+}
+
+static void bench_report(const char* name, double secs, DabPainter* dp,
+						 const PainterStats* before, BenchDoc* doc, double* lat, int count)
+{
+	PainterStats after;
+	painter_get_stats(dp, &after);
+	printf("%-28s %10.0f %9.1f %9.1f",
+		name, (after.dabs - before->dabs) / secs,
+		(after.flushes - before->flushes) / secs, doc->bytes / secs / (1024*1024));
+	if (lat) {
+		qsort(lat, count, sizeof(double), bench_compare);
+		printf(" %8.1f %8.1f", lat[count / 2] * 1e6, lat[count * 99 / 100] * 1e6);
+	}
+	printf("\n");
+}
+
+static void bench_stroke(DabPainter* dp, BenchDoc* doc, const char* name,
+						 Tablet_InputEvent* events, int count, bool batched, double* lat)
+{
+	// time each input event as the tablet handler would send it;
+	// the latency includes any flush it triggers.
+	PainterStats before;
+	double start, t0, t1;
+	int i;
+	painter_get_stats(dp, &before);
+	doc->bytes = 0;
+	doc->merges = 0;
+	start = bench_seconds();
+	for (i=0; i<=count; i++) {
+		t0 = bench_seconds();
+		if (batched && i % c_batchEvents == 0)
+			painter_begin_batch(dp);
+		if (i == 0)
+			painter_begin(dp, &events[i]);
+		else if (i < count)
+			painter_draw(dp, &events[i]);
+		if (batched && (i % c_batchEvents == c_batchEvents - 1 || i == count))
+			painter_end_batch(dp);
+		if (i == count)
+			painter_end(dp);
+		t1 = bench_seconds();
+		lat[i] = t1 - t0;
+	}
+	bench_report(name, t1 - start, dp, &before, doc, lat, count + 1);
+}
+
+static void bench_replay(DabPainter* dp, BenchDoc* doc, const char* path)
+{
+	PainterStats before;
+	double start;
+	byte* data;
+	long size;
+	int strokes;
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		printf("%s: cannot open\n", path);
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = cpart_alloc(size ? size : 1);
+	size = (long)fread(data, 1, size, fp);
+	fclose(fp);
+
+	painter_get_stats(dp, &before);
+	doc->bytes = 0;
+	doc->merges = 0;
+	start = bench_seconds();
+	strokes = strokelog_replay(data, size, dp, &doc->mode);
+	bench_report(path, bench_seconds() - start, dp, &before, doc, 0, 0);
+	if (strokes < 0)
+		printf("%s: malformed log; replayed up to the error\n", path);
+	cpart_free(data);
+}
+
+int main(int argc, char* argv[])
+{
+	BenchDoc doc = {0};
+	DabPainter* dp;
+	Tablet_InputEvent* events;
+	double* lat;
+	RGBA col = { 32, 64, 128, 255 };
+	char name[64];
+	int shape, s, p, batched, i;
+
+	surface_create(&doc.sd, surface_rgba8, c_docSize, c_docSize);
+	surface_fill(&doc.sd, rgba_white);
+	doc.mode = blendNormal;
+
+	dp = createDabPainter(0);
+	painter_set_output(dp, bench_output, &doc);
+	painter_set_colour(dp, col);
+	painter_set_alpha_range(dp, 64, 255);
+
+	events = cpart_alloc(c_strokeEvents * sizeof(Tablet_InputEvent));
+	lat = cpart_alloc((c_strokeEvents + 1) * sizeof(double));
+
+	printf("%-28s %10s %9s %9s %8s %8s\n", "stroke", "dabs/s", "flushes/s", "MB/s", "p50 us", "p99 us");
+	for (shape=0; shape<numShapes; shape++) {
+		bench_make_stroke(shape, events, c_strokeEvents);
+		for (s=0; s<(int)(sizeof(brushSizes)/sizeof(int)); s++) {
+			for (p=0; p<(int)(sizeof(spacings)/sizeof(int)); p++) {
+				int size = brushSizes[s] << 8;
+				painter_set_size_range(dp, size / 2, size);
+				painter_set_spacing(dp, size * spacings[p] / 100);
+				for (batched=0; batched<2; batched++) {
+					sprintf(name, "%s %dpx %d%%%s", shapeNames[shape],
+						brushSizes[s], spacings[p], batched ? " batch" : "");
+					bench_stroke(dp, &doc, name, events, c_strokeEvents, batched, lat);
+				}
+			}
+		}
+	}
+
+	// logs set their own brush state, so they go last.
+	for (i=1; i<argc; i++)
+		bench_replay(dp, &doc, argv[i]);
+
+	cpart_free(lat);
+	cpart_free(events);
+	surface_destroy(&doc.sd);
+	return 0;
+}
@@ -179,6 +179,15 @@ static int lb_load_into_layer(lua_State *L)
 	return 0;
 }
 
+static int lb_save_stroke_log(lua_State *L)
+{
+	size_t len;
+	const char* path = luaL_checklstring(L, 1, &len);
+	stringref s; { s.size = len; s.data = path; }
+	save_stroke_log(s);
+	return 0;
+}
+
 static int lb_create_frame(lua_State *L)
 {
 	Frame* parent = opt_frame(L, 1, g_root_frame);
@@ -339,6 +348,35 @@ static int lb_set_brush(lua_State *L)
 	return 0;
 }
 
+static int lb_set_symmetry(lua_State *L)
+{
+	static const char* const modeNames[] = {
+		"none",
+		"mirror",
+		"radial",
+		"kaleidoscope",
+	0};
+	static PainterSymmetry modes[] = {
+		symmetryNone,
+		symmetryMirror,
+		symmetryRadial,
+		symmetryKaleidoscope,
+	};
+	int mode = luaL_checkoption(L, 1, "none", modeNames);
+	int n = luaL_optint(L, 2, 1);
+	float x = (float)luaL_optnumber(L, 3, -1);
+	float y = (float)luaL_optnumber(L, 4, -1);
+	set_brush_symmetry(modes[mode], n, x, y);
+	return 0;
+}
+
+static int lb_set_smoothing(lua_State *L)
+{
+	bool smooth = lua_toboolean(L, 1) ? true : false;
+	set_brush_smoothing(smooth);
+	return 0;
+}
+
 static int lb_begin_painting(lua_State *L)
 {
 	begin_painting();
@@ -385,6 +423,7 @@ static const luaL_Reg api_funcs[] = {
   {"new_layer", lb_new_layer},
   {"delete_layer", lb_delete_layer},
   {"load_into_layer", lb_load_into_layer},
+  {"save_stroke_log", lb_save_stroke_log},
   {"CreateFrame", lb_create_frame},
   {"destroy_frame", lb_destroy_frame},
   {"insert_frame", lb_insert_frame},
@@ -398,6 +437,8 @@ static const luaL_Reg api_funcs[] = {
   {"get_layer_info", lb_get_layer_info},
   {"show_layer", lb_show_layer},
   {"set_brush", lb_set_brush},
+  {"set_symmetry", lb_set_symmetry},
+  {"set_smoothing", lb_set_smoothing},
   {"begin_painting", lb_begin_painting},
   {"active_layer", lb_active_layer},
   {"undo", lb_undo},
@@ -4,10 +4,15 @@
 #include "tablet_input.h"  // for Tablet_InputEvent protocol.
 #include "skunkpad.h"
 #include "graphics.h"
-#include "shapes.h"
+#include "dabmask.h"
+#include "brushstamp.h"
+#include "tileaccum.h"
+#include "thread.h"
+#include "workpool.h"
+#include "blend.h"
+#include "simd.h"
 
-#include <math.h>
-#include <limits.h>
+#include <math.h> // symmetry set up only.
 
 
 #define Q8_BITS 8
@@ -21,44 +26,159 @@
 #define Q8_TOF(X) ((X) * (1/256.0f))
 #define Q8_FTOQ(X) ((int)((X) * Q8_ONE))
 
+// Q8 to dab mask steps (DABMASK_STEPS=4 per pixel), rounding to nearest.
+#define Q8_STEP_BITS (Q8_BITS - 2)
+#define Q8_TOSTEP(X) (((X) + (1 << (Q8_STEP_BITS-1))) >> Q8_STEP_BITS)
+
 typedef uint16 sample; // colour sample.
 
+// an input sample mapped to brush parameters.
+typedef struct StrokeSample {
+	int x, y;			// Q8 document coords
+	int size;			// Q8
+	int alpha;			// 0-255
+} StrokeSample;
+
+// integer DDA: steps value by delta*num/den exactly, carrying the
+// remainder in err, so there is no drift along a segment.
+typedef struct StrokeDDA {
+	int value, step, rem, err, den, dir;
+} StrokeDDA;
+
+// accumulators: one is painted while the previous one is merged.
+#define PAINTER_BUFFERS 2
+
+struct PainterBuffer {
+	TileAccum* tiles;
+	RGBA col;				// colour of coverage tiles.
+	int scale;				// log2 of the upsampling from the tiles.
+	uint16* src;			// upsampling scratch, allocated on first use.
+	uint16* row;
+	uint16* band;
+	volatile int merged;	// 0 from submit until the merge is done.
+};
+
+// a dab reduced to what is needed to render it on any thread.
+typedef enum DabKind { dabStamp, dabMask, dabCircle } DabKind;
+
+typedef struct Dab {
+	DabKind kind;
+	int size;			// Q8 for stamps, steps for masks, radius for circles.
+	int fx, fy;			// sub-pixel offset of the top-left (stamps, masks).
+	bool turned;		// stamps: turned by turn, for a symmetric copy.
+	BrushStampTurn turn;
+	RGBA16 col;			// pre-multiplied; col.a alone for coverage tiles.
+	iRect r;			// pixel extent in document space.
+} Dab;
+
+// per-thread scratch for rendering dabs.
+typedef struct DabContext {
+	DabMaskCache* masks;
+	BrushStampTarget* target;
+} DabContext;
+
+// a dab overlapping a bin; sorted by bin, then dab order.
+typedef struct DabBin {
+	int bx, by, dab;
+} DabBin;
+
+// most copies of each dab: kaleidoscope symmetry with 16 sectors.
+#define PAINTER_MAX_COPIES 32
+
+// bins match the layer's 256px tiles (c_tileSize in frames.c), and
+// must be whole accum tiles so that each tile has a single renderer.
+#define PAINTER_BIN_BITS 8
+
+// arguments for merging tiles through a DabPainterOutput.
+typedef struct PainterMerge {
+	DabPainterOutput func;
+	void* obj;
+	RGBA col;
+	PainterBuffer* buf;		// tiles, scale and scratch.
+} PainterMerge;
+
 struct DabPainter {
 	GfxDraw draw;
-	SurfaceData accum;
-	SurfaceData* brush;
-	float brushWidth, brushHeight;
+	TileAccum* tiles;	// deferred paint.
+	int accum_format;	// format of the current stroke's tiles.
+	PainterBuffer buffers[PAINTER_BUFFERS];
+	int current;		// buffer that owns tiles.
+	DabPainterSubmit submit;
+	void* submit_data;
+	bool coverage;		// accumulate coverage of col for new strokes.
+	int scale;			// log2 reduction of the current stroke's tiles.
+	int reduce;			// log2 reduction of the current stroke's output.
+	int preview;		// reduce for new strokes.
+	Affine2D copies[PAINTER_MAX_COPIES]; // Q8 document transforms.
+	BrushStampTurn turns[PAINTER_MAX_COPIES]; // their linear parts, for stamps.
+	int numCopies;		// copies of each dab; [0] is identity.
+	DabContext* contexts;	// one per pool worker; [0] is this thread.
+	WorkPool* pool;		// renders batches; 0 until the first batch.
+	bool batching;		// defer dabs until the end of the batch.
+	Dab* dabs;			// deferred dabs, in stroke order.
+	int numDabs, maxDabs;
+	DabBin* bins;		// dabs binned for parallel rendering.
+	int maxBins;
+	int* runs;			// start of each bin in bins, plus the end.
+	int maxRuns;
+	BrushStamp* stamp;	// brush mip pyramid, or 0 for round dabs.
 	DabPainterOutput output;
 	void* output_data;
-	iRect dirty;		// Q8 in accum space.
 	int remain;			// remaining dabs.
-	int accum_left;		// Q8 in doc space.
-	int accum_top;		// Q8 in doc space.
-	int accum_size;		// width & height of GfxTarget.
 	int size_min;		// Q8
 	int size_range;		// Q8
 	int spacing;		// Q8
 	int alpha_min;		// 0-255
 	int alpha_range;	// 0-255
-	int prev_x, prev_y;	// Q8 document coords
+	StrokeSample hist[4];	// last four samples, newest last.
+	int carry;			// Q8 distance travelled since the last dab.
+	bool smooth;		// Catmull-Rom smoothing for new strokes.
+	bool smoothing;		// smoothing the current stroke.
 	RGBA col;
 	GfxBlendMode mode;
 	bool started;
+	PainterStats stats;
 };
 
 //GfxImage painter_get_accum(DabPainter* dp) { return dp->accum; }
 //RGBA painter_get_col(DabPainter* dp) { return dp->col; }
 
-static const int c_accumSize = 128;
-static const RGBA c_transparent = {0};
+static const int c_accumMaxTiles = 64; // 2Mb rgba16, 512Kb a16.
+static const int c_stampMinSize = 2 << Q8_BITS; // smaller dabs are round.
+
+// larger brushes are accumulated at a power of two reduced resolution
+// and upsampled when merged, which bounds the cost of each dab.
+static const int c_largeBrushSize = 256 << Q8_BITS;
+static const int c_maxScale = 4;
+static const int c_bandPixels = 65536; // upsampled pixels per output.
 
 DabPainter* createDabPainter(GfxDraw draw)
 {
 	DabPainter* dp = cpart_new(DabPainter);
+	int i;
 	dp->draw = draw;
-	surfaceInitInvalid(&dp->accum);
-	dp->accum_size = 0;
-	dp->brush = 0;
+	// solid colour dabs only need coverage; the colour is applied
+	// as the tiles are merged into the document.
+	dp->coverage = true;
+	dp->accum_format = surface_a16;
+	dp->scale = 0;
+	dp->reduce = 0;
+	dp->preview = 0;
+	painter_set_symmetry(dp, symmetryNone, 1, 0, 0);
+	for (i=0; i<PAINTER_BUFFERS; i++) {
+		dp->buffers[i].tiles = tileaccum_create(dp->accum_format);
+		dp->buffers[i].scale = 0;
+		dp->buffers[i].src = dp->buffers[i].row = dp->buffers[i].band = 0;
+		dp->buffers[i].merged = 1;
+	}
+	dp->current = 0;
+	dp->tiles = dp->buffers[0].tiles;
+	dp->contexts = cpart_new(DabContext);
+	dp->contexts[0].masks = dabmask_create_cache();
+	dp->contexts[0].target = brushstamp_create_target();
+	dp->pool = 0;
+	dp->batching = false;
+	dp->stamp = 0;
 	dp->size_min = Q8_ONE;		// one pixel.
 	dp->size_range = 0;			// no scaling.
 	dp->spacing = Q8_ONE / 10;	// ~10% of size.
@@ -66,53 +186,45 @@ DabPainter* createDabPainter(GfxDraw draw)
 	dp->alpha_range = 255;		// full range.
 	dp->mode = gfxBlendPremultiplied;  // brush mode.
 	dp->started = false;
-	dp->dirty.left = dp->dirty.top = INT_MAX;
-	dp->dirty.right = dp->dirty.bottom = 0;
+	dp->carry = 0;
+	dp->smooth = false;
+	dp->smoothing = false;
+	dp->remain = 0;
 	return dp;
 }
 
-static void painter_upsize(DabPainter* dp)
-{
-	if (dp->draw) {
-		// the accumulation target must be at least 1.5 times the
-		// max size of the brush, so we can accumulate for at least
-		// a distance of 1/4 the max brush size.
-		int required = dp->size_min + dp->size_range;
-		required += required >> 1; // div 2 >= 0
-		// convert from Q8 to int pixels, rounding up.
-		required = Q8_ICEIL(required);
-		if (required < c_accumSize) required = c_accumSize;
-		if (!surfaceValid(&dp->accum)) {
-			surface_create(&dp->accum, surface_rgba16, required, required);
-			surface_fill(&dp->accum, c_transparent);
-			dp->accum_size = required;
-		} else {
-			// grow the target if necessary.
-			if (required > dp->accum_size) {
-				surface_destroy(&dp->accum);
-				surface_create(&dp->accum, surface_rgba16, required, required);
-				surface_fill(&dp->accum, c_transparent);
-				dp->accum_size = required;
-			}
-		}
-	}
-}
+static void painter_flush(DabPainter* dp);
 
 void painter_set_output(DabPainter* dp, DabPainterOutput func, void* data) {
 	dp->output = func;
 	dp->output_data = data;
 }
+void painter_set_submit(DabPainter* dp, DabPainterSubmit func, void* data) {
+	dp->submit = func;
+	dp->submit_data = data;
+}
 void painter_set_brush(DabPainter* dp, SurfaceData* brush) {
-	assert(brush->format == surface_a8);
-	if (brush->format == surface_a8) {
-		dp->brush = brush;
-		dp->brushWidth = (float)brush->width;
-		dp->brushHeight = (float)brush->height;
+	assert(!brush || brush->format == surface_a8);
+	if (dp->stamp) {
+		brushstamp_destroy(dp->stamp);
+		dp->stamp = 0;
 	}
+	// prefilter the brush once here, rather than per dab.
+	if (brush && brush->format == surface_a8)
+		dp->stamp = brushstamp_create(brush);
 }
 void painter_set_colour(DabPainter* dp, RGBA col) {
+	// coverage tiles are merged with the current colour, so any
+	// deferred paint must be merged before it changes.
+	if (dp->tiles && dp->accum_format == surface_a16 &&
+		(col.r != dp->col.r || col.g != dp->col.g ||
+		 col.b != dp->col.b || col.a != dp->col.a))
+		painter_flush(dp);
 	dp->col = col;
 }
+void painter_set_coverage(DabPainter* dp, bool coverage) {
+	dp->coverage = coverage;
+}
 void painter_set_blendMode(DabPainter* dp, GfxBlendMode mode) {
 	dp->mode = mode;
 }
@@ -127,207 +239,765 @@ void painter_set_size_range(DabPainter* dp, int min, int max) {
 	if (max<min) max=min;
 	dp->size_min = min;
 	dp->size_range = max-min;
-	// grow the accumulation target if necessary.
-	painter_upsize(dp);
 }
 void painter_set_spacing(DabPainter* dp, int ratio) {
 	if (ratio<1) ratio = 1;
 	dp->spacing = ratio;
 }
+void painter_set_smoothing(DabPainter* dp, bool smooth) {
+	dp->smooth = smooth;
+}
+void painter_get_stats(DabPainter* dp, PainterStats* stats) {
+	*stats = dp->stats;
+}
+static void painter_add_copy(DabPainter* dp, float c, float s, bool mirror, float x, float y) {
+	// rotate by (c,s) about (x,y), after mirroring in x if required.
+	BrushStampTurn* tn = &dp->turns[dp->numCopies];
+	Affine2D* t = &dp->copies[dp->numCopies++];
+	float m = mirror ? -1.0f : 1.0f;
+	t->Ux = c * m; t->Uy = s * m;
+	t->Vx = -s;    t->Vy = c;
+	t->Tx = x - (t->Ux * x + t->Vx * y);
+	t->Ty = y - (t->Uy * x + t->Vy * y);
+	// brush stamps are turned with the copy; round dabs need not be.
+	tn->ux = (int)floor(t->Ux * 16384 + 0.5f);
+	tn->uy = (int)floor(t->Uy * 16384 + 0.5f);
+	tn->vx = (int)floor(t->Vx * 16384 + 0.5f);
+	tn->vy = (int)floor(t->Vy * 16384 + 0.5f);
+}
+void painter_set_symmetry(DabPainter* dp, PainterSymmetry mode, int n, float x, float y) {
+	int i;
+	x *= Q8_ONE; y *= Q8_ONE;
+	if (n<1) n = 1; else if (n>PAINTER_MAX_COPIES/2) n = PAINTER_MAX_COPIES/2;
+	if (mode == symmetryNone || mode == symmetryMirror) n = 1;
+	dp->numCopies = 0;
+	for (i=0; i<n; i++) {
+		double a = 6.283185307179586 * i / n;
+		painter_add_copy(dp, (float)cos(a), (float)sin(a), false, x, y);
+		if (mode == symmetryMirror || mode == symmetryKaleidoscope)
+			painter_add_copy(dp, (float)cos(a), (float)sin(a), true, x, y);
+	}
+}
+void painter_set_preview(DabPainter* dp, int scale) {
+	if (scale<0) scale = 0;
+	dp->preview = scale;
+}
+
+static void painter_output_tile(void* data, SurfaceData* image, iRect bounds)
+{
+	PainterMerge* m = data;
+	iPair org;
+
+	// the image is a view of the dirty area, so its source
+	// top-left is always the top-left of the image.
+	org.x = org.y = 0;
+
+	// run the callback to merge this part of the deferred paint.
+	m->func(m->obj, image, m->col, org, bounds);
+}
+
+typedef void (*span2_lerp_func)(uint16* dst, const uint16* a, const uint16* b, int len, int f);
+typedef void (*span2_expand_func)(uint16* dst, const uint16* src, int len, int channels, int shift);
+
+// 0 until the first scaled merge, then the selected span functions.
+static span2_lerp_func s_lerp = 0;
+static span2_expand_func s_expand = 0;
+
+static void painter_gather_row(TileAccum* ta, int x, int y, int len, int channels, uint16* dst)
+{
+	// copy a row of pixels that may cross into the next tile; pixels
+	// without a tile are clear.
+	while (len > 0) {
+		AccumTile* t = tileaccum_get(ta, x >> ACCUM_TILE_BITS, y >> ACCUM_TILE_BITS);
+		int lx = x & (ACCUM_TILE_SIZE-1);
+		int n = ACCUM_TILE_SIZE - lx;
+		if (n > len) n = len;
+		if (t)
+			memcpy(dst, t->sd.data + (y & (ACCUM_TILE_SIZE-1)) * t->sd.stride +
+				lx * channels * sizeof(uint16), n * channels * sizeof(uint16));
+		else
+			memset(dst, 0, n * channels * sizeof(uint16));
+		dst += n * channels; x += n; len -= n;
+	}
+}
+
+static void painter_output_scaled(void* data, SurfaceData* image, iRect bounds)
+{
+	// upsample the dirty area of a reduced tile by 2^scale, in bands.
+	// Document pixel X takes reduced pixel X>>scale blended towards the
+	// next one, so each document pixel belongs to exactly one tile; the
+	// painter offsets dabs by half a pixel to centre the result, and
+	// extends each dab's dirty rect a pixel left and up, so the dirty
+	// area covers every document pixel it changes.
+	PainterMerge* m = data;
+	PainterBuffer* buf = m->buf;
+	int s = buf->scale, n = 1 << s;
+	int channels = (image->format == surface_a16) ? 1 : 4;
+	int w = bounds.right - bounds.left, h = bounds.bottom - bounds.top;
+	int pitch = (w + 1) * channels;
+	int y, y0, rows;
+	SurfaceData band;
+	iRect out;
+	iPair org;
+
+	if (!buf->src) {
+		buf->src = cpart_alloc((ACCUM_TILE_SIZE+1) * (ACCUM_TILE_SIZE+1) * 4 * sizeof(uint16));
+		buf->row = cpart_alloc((ACCUM_TILE_SIZE+1) * 4 * sizeof(uint16));
+		buf->band = cpart_alloc(c_bandPixels * 4 * sizeof(uint16));
+	}
+	if (!s_lerp) {
+		s_lerp = cpu_supports_sse2() ? span2_lerp_sse2 : span2_lerp;
+		s_expand = cpu_supports_sse2() ? span2_expand_sse2 : span2_expand;
+	}
+
+	// the dirty area and one more column and row, which may belong
+	// to the neighbouring tiles.
+	for (y=0; y<=h; y++)
+		painter_gather_row(buf->tiles, bounds.left, bounds.top + y, w + 1, channels,
+			buf->src + y * pitch);
+
+	band.format = image->format;
+	band.width = w * n;
+	band.stride = band.width * channels * sizeof(uint16);
+	band.data = (byte*)buf->band;
+	rows = c_bandPixels / band.width;
+	org.x = org.y = 0;
+	out.left = bounds.left * n;
+	out.right = bounds.right * n;
+
+	for (y0=0; y0 < h * n; y0 += rows)
+	{
+		band.height = (h * n - y0 < rows) ? h * n - y0 : rows;
+		for (y=0; y<band.height; y++) {
+			int i = (y0 + y) >> s, f = ((y0 + y) & (n-1)) << (8-s);
+			const uint16* r = buf->src + i * pitch;
+			if (f) {
+				s_lerp(buf->row, r, r + pitch, pitch, f);
+				r = buf->row;
+			}
+			s_expand(buf->band + y * band.width * channels, r, w, channels, s);
+		}
+		out.top = bounds.top * n + y0;
+		out.bottom = out.top + band.height;
+		m->func(m->obj, &band, m->col, org, out);
+	}
+}
+
+void painter_merge(PainterBuffer* buf, DabPainterOutput func, void* obj)
+{
+	PainterMerge m;
+	m.func = func;
+	m.obj = obj;
+	m.col = buf->col;
+	m.buf = buf;
+	tileaccum_output(buf->tiles, buf->scale ? painter_output_scaled : painter_output_tile, &m);
+
+	// finish reading the tiles before the painter may reuse them.
+	thread_fence();
+	buf->merged = 1;
+}
+
+static void painter_render_batch(DabPainter* dp);
 
 static void painter_flush(DabPainter* dp)
 {
-	// round coords OUT from Q8 to integer pixels.
-	iRect dirty;
-	dirty.left = Q8_IFLOOR(dp->dirty.left);
-	dirty.top = Q8_IFLOOR(dp->dirty.top);
-	dirty.right = Q8_ICEIL(dp->dirty.right);
-	dirty.bottom = Q8_ICEIL(dp->dirty.bottom);
+	PainterBuffer* buf = &dp->buffers[dp->current];
+
+	// deferred dabs belong in this accumulator.
+	painter_render_batch(dp);
+	dp->stats.flushes++;
 
-	// check if the dirty rect is non-empty.
-	if (dirty.left < dirty.right && dirty.top < dirty.bottom)
+	if (!dp->submit)
 	{
-		// map the dirty rect to document space.
-		// NB. rect may extend outside the document bounds.
-		//dirty.left += Q8_IFLOOR(dp->accum_left);
-		//dirty.top += Q8_IFLOOR(dp->accum_top);
-		//dirty.right += Q8_IFLOOR(dp->accum_left);
-		//dirty.bottom += Q8_IFLOOR(dp->accum_top);
-
-		// destination rect is the entire accum area.
-		dirty.left = Q8_IFLOOR(dp->accum_left);
-		dirty.top = Q8_IFLOOR(dp->accum_top);
-		dirty.right = dirty.left + dp->accum_size;
-		dirty.bottom = dirty.top + dp->accum_size;
-
-		if (dp->output)
-		{
-			iPair org;
+		// merge the dirty area of each tile in use, then clear them.
+		PainterMerge m;
+		m.func = dp->output;
+		m.obj = dp->output_data;
+		m.col = dp->col;
+		m.buf = buf;
+		buf->scale = dp->scale - dp->reduce;
+		tileaccum_flush(dp->tiles, !dp->output ? 0 :
+			buf->scale ? painter_output_scaled : painter_output_tile, &m);
+		return;
+	}
 
-			// determine the source top-left within the accum image.
-			//org.x = Q8_IFLOOR(dp->dirty.left);
-			//org.y = Q8_IFLOOR(dp->dirty.top);
+	if (!tileaccum_count(buf->tiles))
+		return;
 
-			// source top-left is always the top-left of the accum image.
-			org.x = org.y = 0;
-			
-			// run the callback to merge all deferred paint.
-			dp->output(dp->output_data, &dp->accum, org, dirty);
-		}
+	// hand this accumulator over to be merged in the background.
+	buf->col = dp->col;
+	buf->scale = dp->scale - dp->reduce;
+	buf->merged = 0;
+	dp->submit(dp->submit_data, buf);
 
-		// make the dirty rect empty.
-		dp->dirty.left = dp->dirty.top = INT_MAX;
-		dp->dirty.right = dp->dirty.bottom = 0;
+	// continue in the next accumulator once its last merge is done;
+	// buffers are submitted and merged in order, so paint is never
+	// merged out of order.
+	dp->current = (dp->current + 1) % PAINTER_BUFFERS;
+	buf = &dp->buffers[dp->current];
+	while (!buf->merged)
+		thread_yield();
+	thread_fence();
+
+	// clear the merged tiles for reuse; they may be from before the
+	// format last changed, which only recreated the tiles then current.
+	if (tileaccum_format(buf->tiles) != dp->accum_format) {
+		tileaccum_destroy(buf->tiles);
+		buf->tiles = tileaccum_create(dp->accum_format);
 	}
+	else
+		tileaccum_flush(buf->tiles, 0, 0);
+	dp->tiles = buf->tiles;
 }
 
 static const int c_deferMinPixels = 10;
+static const int c_deferMaxPixels = ACCUM_TILE_SIZE;
 
-static void painter_set_bounds(DabPainter* dp, int x, int y)
+static void painter_set_budget(DabPainter* dp)
 {
-	int brushSize, maxDist, dist, remain;
-	int half = dp->accum_size << (Q8_BITS-1); // to Q8, div 2 >= 0
-
-	// center the Q8 accum bounds on the (x,y) coords,
-	// but aligned on pixel boundaries (half way between samples)
-	dp->accum_left = Q8_CEIL(x - half);
-	dp->accum_top = Q8_CEIL(y - half);
+	int dist;
 
 	// calculate max number of dabs that can be painted before
-	// deferred output must be flushed.
-	brushSize = Q8_ICEIL(dp->size_min + dp->size_range);
-	maxDist = (dp->accum_size >> 1) - ((brushSize + 1) >> 1);
-
-	dist = brushSize;
+	// deferred output must be flushed; this bounds the latency
+	// before paint appears, independent of where the dabs land.
+	// distances are in accumulator pixels, which may be reduced.
+	dist = Q8_ICEIL((dp->size_min + dp->size_range) >> dp->scale);
 	if (dist < c_deferMinPixels) dist = c_deferMinPixels;
-	if (dist > maxDist) dist = maxDist;
-	remain = (dist << Q8_BITS) / dp->spacing;
-	dp->remain = remain;
+	if (dist > c_deferMaxPixels) dist = c_deferMaxPixels;
+	dp->remain = ((dist << dp->scale) << Q8_BITS) / dp->spacing;
+	if (dp->remain < 1) dp->remain = 1;
 }
 
 static void paint_start_painting(DabPainter* dp, bool clear)
 {
-	// clear the accum buffer if required.
+	// discard any deferred paint if required.
 	// start with a fully transparent layer.
-	if (clear && surfaceValid(&dp->accum))
-		surface_fill(&dp->accum, c_transparent);
+	if (clear && dp->tiles) {
+		int format = dp->coverage ? surface_a16 : surface_rgba16;
+		dp->numDabs = 0;
+		tileaccum_flush(dp->tiles, 0, 0);
+		// switch accumulator format between strokes.
+		if (format != dp->accum_format) {
+			tileaccum_destroy(dp->tiles);
+			dp->tiles = tileaccum_create(format);
+			dp->buffers[dp->current].tiles = dp->tiles;
+			dp->accum_format = format;
+		}
+		// accumulate large brushes at reduced resolution, and previews
+		// at no more than their output resolution.
+		dp->reduce = dp->preview;
+		dp->scale = dp->reduce;
+		while (((dp->size_min + dp->size_range) >> dp->scale) > c_largeBrushSize &&
+			dp->scale < dp->reduce + c_maxScale)
+			dp->scale++;
+	}
 }
 
 static void paint_end_painting(DabPainter* dp)
 {
-	// nothing to do.
+	// render any dabs deferred by batching.
+	painter_render_batch(dp);
 }
 
-static void paint_dab_overflow(DabPainter* dp, int x, int y)
+static void paint_dab_overflow(DabPainter* dp)
 {
-	// must stop painting so we can render the accum target.
+	// must stop painting so we can render the accum tiles.
 	paint_end_painting(dp);
 
 	// flush deferred paint to the document.
 	painter_flush(dp);
 
-	// begin painting to the accum target again.
-	paint_start_painting(dp, true);
+	// begin painting to the accum tiles again.
+	paint_start_painting(dp, false);
 
-	// reset accum bounds centered on this dab.
-	painter_set_bounds(dp, x, y);
+	// start a new dab budget.
+	painter_set_budget(dp);
 }
 
-static void paint_dab(DabPainter* dp, int x, int y, int alpha, int size)
+static void painter_shape_dab(DabPainter* dp, int x, int y, int alpha, int size,
+	const BrushStampTurn* turn, Dab* d)
+{
+	int left, top, qs;
+	int up = dp->scale - dp->reduce;
+
+	if (dp->scale)
+	{
+		// to reduced space, offset so the upsampled dab is centred
+		// (see painter_output_scaled); previews are not offset.
+		int bias = (((1 << up) - 1) << (Q8_BITS-1)) >> up;
+		x = (x >> dp->scale) + bias;
+		y = (y >> dp->scale) + bias;
+		size >>= dp->scale;
+	}
+	qs = Q8_TOSTEP(size);
+
+	// top-left of the dab in Q8 accumulator space.
+	left = x - (size>>1);
+	top = y - (size>>1);
+
+	// pre-multiply RGB in [0,255] by alpha in [0,255].
+	d->col.r = dp->col.r * (1+alpha);
+	d->col.g = dp->col.g * (1+alpha);
+	d->col.b = dp->col.b * (1+alpha);
+	d->col.a = 255 * (1+alpha); // [0,65280]; >>8 -> [0,255]
+
+	// choose how to render the dab, and find its pixel extent.
+	if (dp->stamp && size >= c_stampMinSize)
+	{
+		// brush stamp sampled from the mip pyramid; the Q8
+		// fraction of the top-left is the sub-pixel offset. a turned
+		// brush needs bounds that hold it at any angle.
+		int side = turn ? brushstamp_turned_size(size, turn) : size;
+		left = x - (side>>1);
+		top = y - (side>>1);
+		d->kind = dabStamp;
+		d->size = size;
+		d->turned = (turn != 0);
+		if (turn)
+			d->turn = *turn;
+		d->fx = left & Q8_MASK; d->fy = top & Q8_MASK;
+		d->r.left = Q8_IFLOOR(left); d->r.top = Q8_IFLOOR(top);
+		d->r.right = d->r.left + BRUSHSTAMP_EXTENT(side, d->fx);
+		d->r.bottom = d->r.top + BRUSHSTAMP_EXTENT(side, d->fy);
+	}
+	else if (qs <= DABMASK_MAX_SIZE * DABMASK_STEPS)
+	{
+		// anti-aliased dab from the mask cache; the sub-pixel
+		// phase of the top-left selects the mask.
+		int qx = Q8_TOSTEP(left), qy = Q8_TOSTEP(top);
+		if (qs < 1) qs = 1;
+		d->kind = dabMask;
+		d->size = qs;
+		d->fx = qx & (DABMASK_STEPS-1); d->fy = qy & (DABMASK_STEPS-1);
+		d->r.left = qx >> 2; d->r.top = qy >> 2; // steps to pixels, floor.
+		d->r.right = d->r.left + DABMASK_EXTENT(qs, d->fx);
+		d->r.bottom = d->r.top + DABMASK_EXTENT(qs, d->fy);
+	}
+	else
+	{
+		// large dabs do not need edge anti-aliasing.
+		int radius = Q8_IFLOOR(size) >> 1;
+		int cx = Q8_IFLOOR(x), cy = Q8_IFLOOR(y);
+		d->kind = dabCircle;
+		d->size = radius;
+		d->fx = d->fy = 0;
+		d->r.left = cx - radius; d->r.top = cy - radius;
+		d->r.right = cx + radius + 1; d->r.bottom = cy + radius + 1;
+	}
+}
+
+static void painter_claim_dab(DabPainter* dp, const iRect* r)
+{
+	// allocate the tiles under the dab and extend their dirty rects;
+	// tiles are only allocated here, on the painter's thread.
+	int tx, ty;
+	for (ty = r->top >> ACCUM_TILE_BITS; ty <= (r->bottom-1) >> ACCUM_TILE_BITS; ty++)
+	{
+		for (tx = r->left >> ACCUM_TILE_BITS; tx <= (r->right-1) >> ACCUM_TILE_BITS; tx++)
+		{
+			AccumTile* t = tileaccum_tile(dp->tiles, tx, ty);
+			int ox = tx << ACCUM_TILE_BITS, oy = ty << ACCUM_TILE_BITS;
+			accumtile_touch(t, r->left - ox, r->top - oy, r->right - ox, r->bottom - oy);
+		}
+	}
+}
+
+static void painter_render_dab(DabContext* ctx, const BrushStamp* stamp, TileAccum* ta,
+	const Dab* d, const iRect* clip)
+{
+	// render the part of the dab inside clip, which must cover whole
+	// tiles, into claimed tiles; safe on any thread with its own ctx.
+	const SurfaceData* cov = 0;
+	int format = tileaccum_format(ta);
+	int px = d->r.left, py = d->r.top;
+	int tx, ty;
+	iRect c = d->r;
+	if (clip->left > c.left) c.left = clip->left;
+	if (clip->top > c.top) c.top = clip->top;
+	if (clip->right < c.right) c.right = clip->right;
+	if (clip->bottom < c.bottom) c.bottom = clip->bottom;
+	if (c.left >= c.right || c.top >= c.bottom)
+		return;
+
+	if (d->kind == dabStamp)
+	{
+		// only resample the part of a large stamp inside the clip.
+		iRect local;
+		local.left = c.left - px; local.top = c.top - py;
+		local.right = c.right - px; local.bottom = c.bottom - py;
+		if (d->turned)
+			cov = brushstamp_render_turned(stamp, ctx->target, d->size, d->fx, d->fy,
+				&d->turn, &local);
+		else
+			cov = brushstamp_render_to(stamp, ctx->target, d->size, d->fx, d->fy, &local);
+		px = c.left; py = c.top;
+	}
+	else if (d->kind == dabMask)
+		cov = dabmask_get(ctx->masks, d->size, d->fx, d->fy);
+
+	// paint the dab into each tile it overlaps.
+	for (ty = c.top >> ACCUM_TILE_BITS; ty <= (c.bottom-1) >> ACCUM_TILE_BITS; ty++)
+	{
+		for (tx = c.left >> ACCUM_TILE_BITS; tx <= (c.right-1) >> ACCUM_TILE_BITS; tx++)
+		{
+			AccumTile* t = tileaccum_get(ta, tx, ty);
+			int ox = tx << ACCUM_TILE_BITS, oy = ty << ACCUM_TILE_BITS;
+			int cx = d->r.left + d->size - ox, cy = d->r.top + d->size - oy;
+			assert(t); // claimed by painter_claim_dab.
+			if (format == surface_a16) {
+				if (cov)
+					dabmask_blend_a16(&t->sd, px - ox, py - oy, cov, d->col.a);
+				else
+					shape_circle_fill_a16(&t->sd, cx, cy, d->size, d->col.a);
+			} else {
+				if (cov)
+					dabmask_blend_rgba16(&t->sd, px - ox, py - oy, cov, d->col);
+				else
+					shape_circle_fill_rgba16(&t->sd, cx, cy, d->size, d->col);
+			}
+		}
+	}
+}
+
+static void paint_dab_copy(DabPainter* dp, int x, int y, int alpha, int size,
+	const BrushStampTurn* turn, bool spent)
 {
-	int left, top;
-	int limit = dp->accum_size << Q8_BITS; // to Q8.
+	Dab d;
+	iRect claim;
+
+	painter_shape_dab(dp, x, y, alpha, size, turn, &d);
 
-	// check if the dab extends outside accum bounds.
-	//if (left < 0 || top < 0 ||
-	//	left + size > limit || top + size > limit)
-	if (!--dp->remain)
+	// upsampling reads a reduced pixel from the left and above.
+	claim = d.r;
+	if (dp->scale > dp->reduce) {
+		claim.left--;
+		claim.top--;
+	}
+
+	// flush when the dab budget runs out, or when this dab would
+	// take the accumulator over its tile budget; symmetric copies
+	// share both, so all sectors are merged in one pass.
+	if (spent || (tileaccum_count(dp->tiles) &&
+		tileaccum_count(dp->tiles) + tileaccum_missing(dp->tiles, &claim) >
+			c_accumMaxTiles * dp->numCopies))
 	{
 		// flush deferred paint to output and reset the painter.
 		// NB. moved out of line because this is the slow path.
-		paint_dab_overflow(dp, x, y);
+		paint_dab_overflow(dp);
+	}
 
-		// translate top-left of dab to repositioned accum space.
-		//left = x - (size>>1) - dp->accum_left;
-		//top = y - (size>>1) - dp->accum_top;
+	painter_claim_dab(dp, &claim);
+	dp->stats.dabs++;
+
+	if (dp->batching)
+	{
+		// defer the dab until the end of the batch.
+		if (dp->numDabs == dp->maxDabs) {
+			dp->maxDabs = dp->maxDabs ? dp->maxDabs * 2 : 256;
+			dp->dabs = realloc(dp->dabs, dp->maxDabs * sizeof(Dab));
+		}
+		dp->dabs[dp->numDabs++] = d;
 	}
+	else
+	{
+		// paint the dab into the accum tiles now.
+		painter_render_dab(&dp->contexts[0], dp->stamp, dp->tiles, &d, &d.r);
+	}
+}
 
-	// translate top-left of dab to accum space.
-	left = x - (size>>1) - dp->accum_left,
-	top = y - (size>>1) - dp->accum_top;
+static void paint_dab(DabPainter* dp, int x, int y, int alpha, int size)
+{
+	// one step of the dab budget, however many copies are painted.
+	bool spent = !--dp->remain;
+	int i;
 
-	// at this point we assume the dab fits within the accum
-	// bounds, which will always be true unless painter_upsize
-	// has failed to grow the accum target.
+	paint_dab_copy(dp, x, y, alpha, size, 0, spent);
+
+	// symmetric copies go into the same accumulator.
+	for (i=1; i<dp->numCopies; i++) {
+		const Affine2D* t = &dp->copies[i];
+		float fx = (float)x, fy = (float)y;
+		int cx = (int)floor(fx * t->Ux + fy * t->Vx + t->Tx + 0.5f);
+		int cy = (int)floor(fx * t->Uy + fy * t->Vy + t->Ty + 0.5f);
+		paint_dab_copy(dp, cx, cy, alpha, size, &dp->turns[i], false);
+	}
+}
 
-	// paint the dab into the accum target.
-	if (dp->brush)
-	{
-		RGBA16 col;
-		int px = Q8_IFLOOR(left), py = Q8_IFLOOR(top);
-		int sz = Q8_IFLOOR(size);
 
-		// pre-multiply RGB in [0,255] by alpha in [0,255].
-		col.r = dp->col.r * (1+alpha);
-		col.g = dp->col.g * (1+alpha);
-		col.b = dp->col.b * (1+alpha);
-		col.a = 255 * (1+alpha); // [0,65280]; >>8 -> [0,255]
+// parallel batches.
 
-		// accumulate alpha-only brush shape.
-		// TODO: size.
-		// surface_blend(&dp->accum, px, py, dp->brush, dp->mode, alpha);
-		shape_circle_fill_rgba16(&dp->accum, px, py, sz, col);
+static int dabbin_compare(const void* a, const void* b)
+{
+	// by bin, then in stroke order, so every tile sees its dabs in
+	// the same order as when painting them one at a time.
+	const DabBin* p = a;
+	const DabBin* q = b;
+	if (p->by != q->by) return (p->by < q->by) ? -1 : 1;
+	if (p->bx != q->bx) return (p->bx < q->bx) ? -1 : 1;
+	return (p->dab < q->dab) ? -1 : (p->dab > q->dab);
+}
+
+static void painter_render_bin(void* data, int index, int worker)
+{
+	DabPainter* dp = data;
+	int i = dp->runs[index], end = dp->runs[index+1];
+	iRect clip;
+	clip.left = dp->bins[i].bx << PAINTER_BIN_BITS;
+	clip.top = dp->bins[i].by << PAINTER_BIN_BITS;
+	clip.right = clip.left + (1 << PAINTER_BIN_BITS);
+	clip.bottom = clip.top + (1 << PAINTER_BIN_BITS);
+	for (; i<end; i++)
+		painter_render_dab(&dp->contexts[worker], dp->stamp, dp->tiles,
+			&dp->dabs[dp->bins[i].dab], &clip);
+}
+
+static void painter_create_pool(DabPainter* dp)
+{
+	// one worker per processor, counting this thread.
+	int i, size;
+	dp->pool = workpool_create(thread_cpu_count() - 1);
+	size = workpool_size(dp->pool);
+	dp->contexts = realloc(dp->contexts, size * sizeof(DabContext));
+	for (i=1; i<size; i++) {
+		dp->contexts[i].masks = dabmask_create_cache();
+		dp->contexts[i].target = brushstamp_create_target();
+	}
+}
+
+static void painter_render_batch(DabPainter* dp)
+{
+	int i, n = 0, numRuns = 0;
+
+	if (!dp->numDabs)
+		return;
+
+	// bin each deferred dab by the bins it overlaps.
+	for (i=0; i<dp->numDabs; i++) {
+		const iRect* r = &dp->dabs[i].r;
+		int bx, by;
+		for (by = r->top >> PAINTER_BIN_BITS; by <= (r->bottom-1) >> PAINTER_BIN_BITS; by++) {
+			for (bx = r->left >> PAINTER_BIN_BITS; bx <= (r->right-1) >> PAINTER_BIN_BITS; bx++) {
+				if (n == dp->maxBins) {
+					dp->maxBins = dp->maxBins ? dp->maxBins * 2 : 256;
+					dp->bins = realloc(dp->bins, dp->maxBins * sizeof(DabBin));
+				}
+				dp->bins[n].bx = bx; dp->bins[n].by = by; dp->bins[n].dab = i;
+				n++;
+			}
+		}
+	}
+	qsort(dp->bins, n, sizeof(DabBin), dabbin_compare);
+
+	// find where each bin starts.
+	if (n + 1 > dp->maxRuns) {
+		dp->maxRuns = n + 1;
+		dp->runs = realloc(dp->runs, dp->maxRuns * sizeof(int));
+	}
+	for (i=0; i<n; i++) {
+		if (!i || dp->bins[i].bx != dp->bins[i-1].bx || dp->bins[i].by != dp->bins[i-1].by)
+			dp->runs[numRuns++] = i;
 	}
+	dp->runs[numRuns] = n;
 
-	// update the dirty rectangle with the dab extent.
-	if (left < dp->dirty.left) dp->dirty.left = left;
-	if (top < dp->dirty.top) dp->dirty.top = top;
-	if (left+size > dp->dirty.right) dp->dirty.right = left+size;
-	if (top+size > dp->dirty.bottom) dp->dirty.bottom = top+size;
+	// bins touch disjoint tiles, so they can render in any order.
+	if (!dp->pool)
+		painter_create_pool(dp);
+	workpool_run(dp->pool, numRuns, painter_render_bin, dp);
+
+	dp->numDabs = 0;
 }
 
-void painter_begin(DabPainter* dp, struct Tablet_InputEvent* e)
+// stroke walker.
+
+static int isqrt64(uint64 n)
+{
+	// bitwise integer square root.
+	uint64 root = 0, bit = (uint64)1 << 62;
+	while (bit > n) bit >>= 2;
+	while (bit) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else root >>= 1;
+		bit >>= 2;
+	}
+	return (int)root;
+}
+
+static void dda_init(StrokeDDA* d, int value, int delta, int first, int num, int den)
+{
+	// start at value + delta*first/den, step by delta*num/den.
+	int64 mag = (delta < 0) ? -(int64)delta : delta;
+	int64 start = mag * first;
+	int64 step = mag * num;
+	d->dir = (delta < 0) ? -1 : 1;
+	d->value = value + d->dir * (int)(start / den);
+	d->err = (int)(start % den);
+	d->step = d->dir * (int)(step / den);
+	d->rem = (int)(step % den);
+	d->den = den;
+}
+
+static __inline void dda_step(StrokeDDA* d)
 {
-	int qx, qy;
+	d->value += d->step;
+	d->err += d->rem;
+	if (d->err >= d->den) {
+		d->err -= d->den;
+		d->value += d->dir;
+	}
+}
 
-	// map pressure to alpha and size.
-	int alpha = dp->alpha_min + (int)(e->pressure * dp->alpha_range);
-	int size = dp->size_min + (int)(e->pressure * dp->size_range);
+int painter_quantize_pressure(double pressure)
+{
+	int p = (int)(pressure * PAINTER_PRESSURE_ONE);
+	if (p < 0) p = 0; else if (p > PAINTER_PRESSURE_ONE) p = PAINTER_PRESSURE_ONE;
+	return p;
+}
 
+static void painter_sample(DabPainter* dp, Tablet_InputEvent* e, StrokeSample* s)
+{
+	int p;
 	// quantize document coordinates to Q23.8 fixed point.
-	qx = Q8_FTOQ(e->x);
-	qy = Q8_FTOQ(e->y);
+	s->x = Q8_FTOQ(e->x);
+	s->y = Q8_FTOQ(e->y);
+	// map pressure to alpha and size, in fixed point so a recorded
+	// stroke replays to the same dabs.
+	p = painter_quantize_pressure(e->pressure);
+	s->alpha = dp->alpha_min + ((p * dp->alpha_range) >> 16);
+	s->size = dp->size_min + (int)(((int64)p * dp->size_range) >> 16);
+}
+
+static void painter_walk(DabPainter* dp, const StrokeSample* a, const StrokeSample* b)
+{
+	// place dabs every spacing along a->b, continuing from the
+	// distance carried over from previous segments.
+	int dx = b->x - a->x, dy = b->y - a->y;
+	int len = isqrt64((uint64)((int64)dx*dx + (int64)dy*dy)); // Q8
+	int first, n;
+	StrokeDDA x, y, size, alpha;
+
+	if (dp->carry + len < dp->spacing) {
+		dp->carry += len;
+		return; // no dab on this segment.
+	}
+	if (!len) {
+		// spacing was reduced below the carry; the dab is due here.
+		paint_dab(dp, a->x, a->y, a->alpha, a->size);
+		dp->carry = 0;
+		return;
+	}
+
+	// distance along the segment to the first dab.
+	first = dp->spacing - dp->carry;
+	if (first < 0) first = 0; // spacing was reduced mid-stroke.
+	n = 1 + (len - first) / dp->spacing;
+	dp->carry = (len - first) % dp->spacing;
+
+	// interpolate position, size and alpha at each dab.
+	dda_init(&x, a->x, dx, first, dp->spacing, len);
+	dda_init(&y, a->y, dy, first, dp->spacing, len);
+	dda_init(&size, a->size, b->size - a->size, first, dp->spacing, len);
+	dda_init(&alpha, a->alpha, b->alpha - a->alpha, first, dp->spacing, len);
+	while (n--) {
+		paint_dab(dp, x.value, y.value, alpha.value, size.value);
+		dda_step(&x); dda_step(&y);
+		dda_step(&size); dda_step(&alpha);
+	}
+}
+
+static const int c_curveStep = 4 << Q8_BITS; // max chord length.
+static const int c_curveMaxSteps = 16;
+
+static int catmull_rom(int p0, int p1, int p2, int p3, int t)
+{
+	// evaluate the p1->p2 span at t in Q8 [0,256].
+	int64 a1 = p2 - p0;
+	int64 a2 = 2*(int64)p0 - 5*(int64)p1 + 4*(int64)p2 - p3;
+	int64 a3 = -(int64)p0 + 3*(int64)p1 - 3*(int64)p2 + p3;
+	int64 t2 = (int64)t * t, t3 = t2 * t;
+	int64 v = ((int64)p1 << 25) + ((a1 * t) << 16) + ((a2 * t2) << 8) + a3 * t3;
+	return (int)(v >> 25); // includes the 1/2 factor.
+}
 
-	dp->prev_x = qx;
-	dp->prev_y = qy;
+static void painter_curve(DabPainter* dp, const StrokeSample* h)
+{
+	// walk the Catmull-Rom span h[1]->h[2] as a few straight chords;
+	// size and alpha stay linear so pressure cannot overshoot.
+	int dx = h[2].x - h[1].x, dy = h[2].y - h[1].y;
+	int chord, steps, i;
+	StrokeSample a = h[1], b;
+	if (dx < 0) dx = -dx;
+	if (dy < 0) dy = -dy;
+	chord = (dx > dy) ? dx + (dy >> 1) : dy + (dx >> 1); // approx.
+	steps = chord / c_curveStep + 1;
+	if (steps > c_curveMaxSteps) steps = c_curveMaxSteps;
+	for (i=1; i<=steps; i++) {
+		int t = (i << Q8_BITS) / steps;
+		if (i < steps) {
+			b.x = catmull_rom(h[0].x, h[1].x, h[2].x, h[3].x, t);
+			b.y = catmull_rom(h[0].y, h[1].y, h[2].y, h[3].y, t);
+			b.size = h[1].size + (((h[2].size - h[1].size) * t) >> Q8_BITS);
+			b.alpha = h[1].alpha + (((h[2].alpha - h[1].alpha) * t) >> Q8_BITS);
+		}
+		else b = h[2]; // land exactly on the sample.
+		painter_walk(dp, &a, &b);
+		a = b;
+	}
+}
+
+static void painter_push(DabPainter* dp, const StrokeSample* s)
+{
+	StrokeSample* h = dp->hist;
+	h[0] = h[1]; h[1] = h[2]; h[2] = h[3]; h[3] = *s;
+	// smoothing draws one sample behind, since the span h[1]->h[2]
+	// needs the following sample as a control point.
+	if (dp->smoothing) painter_curve(dp, h);
+	else painter_walk(dp, &h[2], &h[3]);
+}
+
+void painter_begin(DabPainter* dp, struct Tablet_InputEvent* e)
+{
+	StrokeSample s;
+
+	painter_sample(dp, e, &s);
+
+	// start a new stroke from this sample.
+	dp->hist[0] = dp->hist[1] = dp->hist[2] = dp->hist[3] = s;
+	dp->carry = 0;
+	dp->smoothing = dp->smooth;
 
 	// record the sample data for redo.
-	// begin_undo_sample(qx, qy, alpha);
+	// begin_undo_sample(s.x, s.y, s.alpha);
 
 	// paint the first dab at the initial position.
-	if (surfaceValid(&dp->accum))
+	if (dp->tiles)
 	{
-		// begin drawing to the accum target.
+		// begin drawing to the accum tiles.
 		paint_start_painting(dp, true);
 
-		// reset accum bounds centered on this dab.
-		painter_set_bounds(dp, qx, qy);
+		// start a new dab budget.
+		painter_set_budget(dp);
 
-		// render the first dab to the accumulation target.
-		// TODO: no need to check bounds, cannot cause a flush,
-		// pos is center of accum, new dirty rect is same.
-		// consider inlining the first dab draw so that the
-		// paint_dab fast path can be moved into painter_draw.
-		paint_dab(dp, qx, qy, alpha, size);
+		// render the first dab to the accumulation tiles.
+		paint_dab(dp, s.x, s.y, s.alpha, s.size);
 	}
 }
 
 void painter_end(DabPainter* dp)
 {
+	if (dp->tiles)
+	{
+		// draw the span to the final sample held back by smoothing.
+		if (dp->smoothing)
+			painter_push(dp, &dp->hist[3]);
+	}
+
 	// stop painting so the app can handle redraw.
 	paint_end_painting(dp);
 
-	if (surfaceValid(&dp->accum))
+	if (dp->tiles)
 	{
 		// commit any remaining deferred paint.
 		painter_flush(dp);
@@ -336,67 +1006,34 @@ void painter_end(DabPainter* dp)
 
 void painter_begin_batch(DabPainter* dp)
 {
-	// begin drawing to the accum target.
+	// begin drawing to the accum tiles.
 	paint_start_painting(dp, false);
+
+	// collect dabs to render in parallel at the end of the batch.
+	dp->batching = true;
 }
 
 void painter_end_batch(DabPainter* dp)
 {
 	// stop painting so the app can handle redraw.
 	paint_end_painting(dp);
-
-	// TODO FIXME TEST DEBUG display the accum buffer.
-	invalidate_all();
+	dp->batching = false;
 }
 
 void painter_draw(DabPainter* dp, Tablet_InputEvent* e)
 {
-	int qx, qy;
-	int x, y, dx, dy;
-	double dist;
-
-	// map pressure to alpha.
-	int alpha = dp->alpha_min + (int)(e->pressure * dp->alpha_range);
-	int size = dp->size_min + (int)(e->pressure * dp->size_range);
+	StrokeSample s;
 
 	//trace("pressure %f", e->pressure);
 
-	if (surfaceValid(&dp->accum))
+	if (dp->tiles)
 	{
-		// quantize document coordinates to Q23.8 fixed point.
-		qx = Q8_FTOQ(e->x);
-		qy = Q8_FTOQ(e->y);
+		painter_sample(dp, e, &s);
 
 		// record the sample data for redo.
-		// begin_undo_sample(qx, qy, alpha);
-
-		// determine distance travelled since previous dab.
-		x = dp->prev_x;
-		y = dp->prev_y;
-		dx = qx - x;
-		dy = qy - y;
-		dist = sqrt((double)dx*dx + (double)dy*dy);
-		if (dist >= dp->spacing)
-		{
-			// dx,dy in Q8 * spacing in Q8 / dist in Q8.
-			// normalize [dx,dy] vector, multiply by spacing.
-			double inc_x = (double)dx * dp->spacing / dist;
-			double inc_y = (double)dy * dp->spacing / dist;
-
-			while (dist >= dp->spacing)
-			{
-				dist -= dp->spacing;
-				x = (int)(x + inc_x);
-				y = (int)(y + inc_y);
-
-				// TODO: interpolate alpha and size along the line.
+		// begin_undo_sample(s.x, s.y, s.alpha);
 
-				paint_dab(dp, x, y, alpha, size);
-			}
-
-			// update previous dab position for next event.
-			dp->prev_x = x;
-			dp->prev_y = y;
-		}
+		// walk from the previous sample, interpolating the dabs.
+		painter_push(dp, &s);
 	}
 }
@@ -0,0 +1,314 @@
+#include "defs.h"
+#include "surface.h"
+#include "tablet_input.h"  // for Tablet_InputEvent protocol.
+#include "skunkpad.h"
+#include "graphics.h"
+#include "app.h"
+#include "thread.h"
+#include "spscring.h"
+
+// The input thread queues painter commands on one ring; the worker
+// rasterizes them and queues full accumulators on another, which the
+// main thread drains to merge into the document (the GPU must only be
+// touched on the main thread) while the worker paints into the next
+// accumulator. Each ring has exactly one producer and one consumer, so
+// neither side takes a lock.
+
+// Each worker marks the end of every stroke it paints in its output,
+// so the main thread knows which merges make up a whole stroke. Every
+// stroke carries the target it was begun with, so the main thread
+// merges it where it was painted, whatever has been selected since.
+
+// Workers can be chained: a preview worker paints strokes at screen
+// resolution, so they show up quickly when zoomed out, and passes every
+// command on to the next worker, which paints at full resolution; the
+// next worker's marks tell the main thread when the preview has been
+// refined.
+
+typedef enum PaintOp {
+	paintBegin,
+	paintDraw,
+	paintEnd,
+	paintBeginBatch,
+	paintEndBatch,
+	paintSetColour,
+	paintSetSize,
+	paintSetAlpha,
+	paintSetPreview,
+	paintSetSymmetry,
+	paintSetSmoothing,
+	paintQuit,
+} PaintOp;
+
+typedef struct PaintCommand {
+	PaintOp op;
+	void* target;		// paintBegin: handed back with the stroke's paint.
+	union {
+		Tablet_InputEvent e;
+		RGBA col;
+		struct { int a, b, c; } i;
+		struct { PainterSymmetry mode; int n; float x, y; } sym;
+	} u;
+} PaintCommand;
+
+typedef struct PaintOutput {
+	PainterBuffer* buf;	// 0 at the end of a stroke.
+	void* target;
+} PaintOutput;
+
+struct PaintWorker {
+	DabPainter* dp;		// owned by the worker thread.
+	PaintWorker* next;	// receives every command after dp; 0 if last.
+	bool previewing;	// paint strokes from the next begin (previews only).
+	void* target;		// of the stroke being painted.
+	StrokeLog* log;		// records commands as sent; 0 if not recording.
+	SpscRing* input;	// PaintCommand: input thread -> worker.
+	SpscRing* output;	// PaintOutput: worker -> main thread.
+	ThreadSignal* wake;	// raised when input is queued.
+	Thread* thread;
+};
+
+static const int c_inputCapacity = 4096;	// ~4s of 1kHz tablet samples.
+static const int c_outputCapacity = 16;		// more than the painter's buffers.
+
+static void paintworker_submit(void* data, PainterBuffer* buf)
+{
+	// worker thread: the painter moves on to its other accumulator,
+	// and waits for this one to be merged before reusing it.
+	PaintWorker* pw = data;
+	PaintOutput out;
+	out.buf = buf;
+	out.target = pw->target;
+	while (!spscring_push(pw->output, &out)) {
+		app_wake();
+		thread_yield();
+	}
+	app_wake();
+}
+
+static void paintworker_discard(void* obj, SurfaceData* image, RGBA col, iPair org, iRect bounds)
+{
+}
+
+static void paintworker_send(PaintWorker* pw, PaintCommand* cmd);
+
+static void paintworker_apply(PaintWorker* pw, PaintCommand* cmd)
+{
+	// a preview worker only paints the strokes it is asked to preview.
+	bool paint = !pw->next || pw->previewing;
+
+	switch (cmd->op)
+	{
+	case paintBegin:
+		pw->target = cmd->target;
+		if (paint) painter_begin(pw->dp, &cmd->u.e);
+		break;
+	case paintDraw: if (paint) painter_draw(pw->dp, &cmd->u.e); break;
+	case paintEnd:
+		if (paint) {
+			painter_end(pw->dp);
+			// everything submitted so far belongs to ended strokes.
+			paintworker_submit(pw, 0);
+		}
+		break;
+	case paintBeginBatch: if (paint) painter_begin_batch(pw->dp); break;
+	case paintEndBatch: if (paint) painter_end_batch(pw->dp); break;
+	case paintSetColour: painter_set_colour(pw->dp, cmd->u.col); break;
+	case paintSetSize:
+		painter_set_size_range(pw->dp, cmd->u.i.a, cmd->u.i.b);
+		painter_set_spacing(pw->dp, cmd->u.i.c);
+		break;
+	case paintSetAlpha: painter_set_alpha_range(pw->dp, cmd->u.i.a, cmd->u.i.b); break;
+	case paintSetSymmetry:
+		painter_set_symmetry(pw->dp, cmd->u.sym.mode, cmd->u.sym.n, cmd->u.sym.x, cmd->u.sym.y);
+		break;
+	case paintSetSmoothing: painter_set_smoothing(pw->dp, (bool)cmd->u.i.a); break;
+	case paintSetPreview:
+		painter_set_preview(pw->dp, cmd->u.i.a);
+		pw->previewing = (cmd->u.i.a > 0);
+		return; // not for the next worker.
+	}
+
+	if (pw->next)
+		paintworker_send(pw->next, cmd);
+}
+
+static unsigned long paintworker_run(void* data)
+{
+	PaintWorker* pw = data;
+	PaintCommand cmd;
+	for (;;) {
+		// rasterize everything queued, then sleep until more arrives.
+		while (spscring_pop(pw->input, &cmd)) {
+			if (cmd.op == paintQuit)
+				return 0;
+			paintworker_apply(pw, &cmd);
+		}
+		thread_signal_wait(pw->wake);
+	}
+}
+
+static void paintworker_send(PaintWorker* pw, PaintCommand* cmd)
+{
+	// input thread, or the previous worker: the ring only fills if the
+	// worker is seconds behind, and dropping samples would break the stroke.
+	while (!spscring_push(pw->input, cmd)) {
+		thread_signal_raise(pw->wake);
+		thread_yield();
+	}
+	thread_signal_raise(pw->wake);
+}
+
+PaintWorker* paintworker_create(DabPainter* dp, PaintWorker* next)
+{
+	PaintWorker* pw = cpart_new(PaintWorker);
+	pw->dp = dp;
+	pw->next = next;
+	pw->previewing = false;
+	pw->target = 0;
+	pw->log = 0;
+	pw->input = spscring_create(sizeof(PaintCommand), c_inputCapacity);
+	pw->output = spscring_create(sizeof(PaintOutput), c_outputCapacity);
+	pw->wake = thread_signal_create();
+	// the worker owns the painter from here on.
+	painter_set_submit(dp, paintworker_submit, pw);
+	pw->thread = thread_create(paintworker_run, pw);
+	return pw;
+}
+
+void paintworker_destroy(PaintWorker* pw)
+{
+	PaintCommand cmd;
+	cmd.op = paintQuit;
+	paintworker_send(pw, &cmd);
+	// the worker may be waiting for a merge before it sees the quit.
+	while (!thread_finished(pw->thread)) {
+		paintworker_drain(pw, paintworker_discard, 0);
+		thread_yield();
+	}
+	thread_join(pw->thread);
+	thread_signal_destroy(pw->wake);
+	spscring_destroy(pw->output);
+	spscring_destroy(pw->input);
+	cpart_free(pw);
+}
+
+void paintworker_begin(PaintWorker* pw, Tablet_InputEvent* e, void* target)
+{
+	PaintCommand cmd;
+	cmd.op = paintBegin;
+	cmd.target = target;
+	cmd.u.e = *e;
+	if (pw->log) strokelog_begin(pw->log, e);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_draw(PaintWorker* pw, Tablet_InputEvent* e)
+{
+	PaintCommand cmd;
+	cmd.op = paintDraw;
+	cmd.u.e = *e;
+	if (pw->log) strokelog_draw(pw->log, e);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_end(PaintWorker* pw)
+{
+	PaintCommand cmd;
+	cmd.op = paintEnd;
+	if (pw->log) strokelog_end(pw->log);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_begin_batch(PaintWorker* pw)
+{
+	PaintCommand cmd;
+	cmd.op = paintBeginBatch;
+	if (pw->log) strokelog_begin_batch(pw->log);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_end_batch(PaintWorker* pw)
+{
+	PaintCommand cmd;
+	cmd.op = paintEndBatch;
+	if (pw->log) strokelog_end_batch(pw->log);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_colour(PaintWorker* pw, RGBA col)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetColour;
+	cmd.u.col = col;
+	if (pw->log) strokelog_set_colour(pw->log, col);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_size(PaintWorker* pw, int min, int max, int spacing)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetSize;
+	cmd.u.i.a = min; cmd.u.i.b = max; cmd.u.i.c = spacing;
+	if (pw->log) strokelog_set_size(pw->log, min, max, spacing);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_alpha(PaintWorker* pw, int min, int max)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetAlpha;
+	cmd.u.i.a = min; cmd.u.i.b = max;
+	if (pw->log) strokelog_set_alpha(pw->log, min, max);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_symmetry(PaintWorker* pw, PainterSymmetry mode, int n, float x, float y)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetSymmetry;
+	cmd.u.sym.mode = mode;
+	cmd.u.sym.n = n;
+	cmd.u.sym.x = x; cmd.u.sym.y = y;
+	if (pw->log) strokelog_set_symmetry(pw->log, mode, n, x, y);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_smoothing(PaintWorker* pw, bool smooth)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetSmoothing;
+	cmd.u.i.a = smooth;
+	if (pw->log) strokelog_set_smoothing(pw->log, smooth);
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_preview(PaintWorker* pw, int scale)
+{
+	PaintCommand cmd;
+	cmd.op = paintSetPreview;
+	cmd.u.i.a = scale;
+	paintworker_send(pw, &cmd);
+}
+
+void paintworker_set_log(PaintWorker* pw, StrokeLog* log)
+{
+	// the log is only touched by the thread sending commands.
+	pw->log = log;
+}
+
+bool paintworker_drain(PaintWorker* pw, DabPainterOutput func, void** target)
+{
+	// main thread: merge accumulators in the order submitted, stopping
+	// after the end of a stroke.
+	PaintOutput out;
+	while (spscring_pop(pw->output, &out)) {
+		if (!out.buf) {
+			if (target)
+				*target = out.target;
+			return true;
+		}
+		painter_merge(out.buf, func, out.target);
+	}
+	return false;
+}
@@ -15,9 +15,11 @@
 #include "glview.h"
 #include "draw.h"
 #include "pancontrol.h"
+#include "thread.h"
 
 #include <math.h>
 #include <limits.h>
+#include <stdio.h> // stroke log.
 
 typedef struct ScaledView ScaledView;
 struct ScaledView {
@@ -51,6 +53,15 @@ static int activeLayerIndex = 0;
 static bool paintMode = false;
 static bool penIsDown = false;
 static DabPainter* painter = 0;
+static PaintWorker* paintWorker = 0;
+static DabPainter* previewPainter = 0;
+static PaintWorker* previewWorker = 0; // takes all commands, passes them on.
+static Frame* previewLayer = 0; // the canvas overlay while shown, or 0.
+static int previewScale = 0;
+static int sentStrokes = 0; // strokes ended and sent to the workers.
+static int paintedStrokes = 0; // strokes painted in full and recorded.
+static bool previewShown = false;
+static StrokeLog* strokeLog = 0; // every command sent to the painters.
 static SurfaceData brush = {0};
 static BlendMode brushMode = blendNormal;
 static bool needCommit = false;
@@ -365,6 +376,22 @@ static void scroll_handler(void* context, UI_Event* e) {
     }
 }
 
+static void start_preview();
+
+// where a stroke goes, as it was when the pen went down; the workers
+// hand it back with the stroke's paint.
+typedef struct StrokeTarget {
+	Frame* layer;
+	BlendMode mode;
+} StrokeTarget;
+
+static StrokeTarget* stroke_target() {
+	StrokeTarget* target = cpart_new(StrokeTarget);
+	target->layer = activeLayer;
+	target->mode = brushMode;
+	return target;
+}
+
 static void tablet_handler(void* context, Tablet_Event* ev) {
     // TODO: check active tool and route (e.g. select)
     // TODO: check modifiers and route (e.g. panning key)
@@ -372,11 +399,11 @@ static void tablet_handler(void* context, Tablet_Event* ev) {
 	{
 	case tablet_event_begin:
 		if (penIsDown)
-			painter_begin_batch(painter);
+			paintworker_begin_batch(previewWorker);
 		break;
 	case tablet_event_end:
 		if (penIsDown)
-			painter_end_batch(painter);
+			paintworker_end_batch(previewWorker);
 		break;
 	case tablet_event_input:
 		{
@@ -395,11 +422,12 @@ static void tablet_handler(void* context, Tablet_Event* ev) {
 				if (penIsDown) {
 					if (e->buttons) {
 						// pen is still down.
-						painter_draw(painter, e);
+						paintworker_draw(previewWorker, e);
 					}
 					else {
 						// pen is up - finish drawing.
-						painter_end(painter);
+						paintworker_end(previewWorker);
+						sentStrokes++;
 						paintMode = false; // stop painting.
 						penIsDown = false;
 					}
@@ -408,7 +436,8 @@ static void tablet_handler(void* context, Tablet_Event* ev) {
 					if (e->buttons) {
 						// pen went down - begin drawing.
 						penIsDown = true;
-						painter_begin(painter, e);
+						start_preview();
+						paintworker_begin(previewWorker, e, stroke_target());
 					}
 				}
 			}
@@ -443,27 +472,126 @@ static void paint_tile(void* data, Frame* frame, int x, int y, GfxImage tile) {
 }
 */
 
-static void paint_output(void* data, SurfaceData* image, iPair org, iRect bounds) {
-	if (activeLayer) {
+static void blend_output(Frame* layer, BlendMode mode, SurfaceData* image, RGBA col, iPair org, iRect bounds) {
+	if (layer) {
 		FrameBlendImage bi;
-		bi.mode = brushMode;
+		bi.mode = mode;
 		bi.alpha = 255;
 		bi.image = image;
+		bi.col = col;
 		// source rect at org (top-left within source image)
 		// the same size as the dest rect (bounds)
 		bi.source.left = org.x; bi.source.top = org.y;
 		bi.source.right = org.x + (bounds.right - bounds.left);
 		bi.source.bottom = org.y + (bounds.bottom - bounds.top);
 		bi.dest = bounds;
-		// flatten the deferred drawing into each tile from the active
+		// flatten the deferred drawing into each tile from the
 		// layer that overlaps the bounds.
-		activeLayer->message(activeLayer, frameBlendImage, &bi);
+		layer->message(layer, frameBlendImage, &bi);
 		// repaint the view.
 		invalidate_all();
 		needCommit = true;
 	}
 }
 
+static void paint_output(void* data, SurfaceData* image, RGBA col, iPair org, iRect bounds) {
+	StrokeTarget* target = data;
+	blend_output(target->layer, target->mode, image, col, org, bounds);
+}
+
+static void paint_preview(void* data, SurfaceData* image, RGBA col, iPair org, iRect bounds) {
+	// bounds are in preview pixels.
+	blend_output(previewLayer, blendNormal, image, col, org, bounds);
+}
+
+static const int c_maxPreviewScale = 6; // 1/64th, for zoom down to 1%.
+
+static void size_preview(int scale) {
+	// (re)create the preview tiles, which clears them.
+	int round = (1 << scale) - 1;
+	previewLayer->message(previewLayer, frameSetScale, &scale);
+	frame_set_size(previewLayer, (document->width + round) >> scale,
+		(document->height + round) >> scale);
+	previewScale = scale;
+}
+
+static void show_preview(bool show) {
+	// the canvas draws the preview just above the active layer; the
+	// preview is not one of its layers.
+	if (document && document->layers)
+		document->layers->message(document->layers, frameSetOverlay, show ? previewLayer : 0);
+	previewShown = show;
+}
+
+static void drop_preview() {
+	if (previewLayer) {
+		show_preview(false);
+		frame_destroy(previewLayer);
+		previewLayer = 0;
+	}
+	previewShown = false;
+}
+
+static void start_preview() {
+	// below 50% zoom, paint each stroke at about screen resolution
+	// first, then refine it at full resolution in the background.
+	int scale = 0;
+	if (document && activeLayer && brushMode == blendNormal) {
+		while (scale < c_maxPreviewScale && scaledView.scale * (2 << scale) <= 1.0f)
+			scale++;
+	}
+	if (scale) {
+		if (!previewLayer) {
+			previewLayer = frame_create_layer(0);
+			previewLayer->message(previewLayer, frameSetRenderContext, gfxContext);
+			size_preview(scale);
+		}
+		else if (previewShown)
+			scale = previewScale; // keep the resolution until refined.
+		else if (scale != previewScale)
+			size_preview(scale);
+		show_preview(true);
+	}
+	paintworker_set_preview(previewWorker, scale);
+}
+
+static void merge_paint() {
+	// merge paint the raster workers have finished, previews first.
+	StrokeTarget* target;
+	if (previewWorker)
+		while (paintworker_drain(previewWorker, paint_preview, 0)) {}
+	if (paintWorker)
+		while (paintworker_drain(paintWorker, paint_output, (void**)&target)) {
+			// the stroke is in its layer; record it for undo.
+			undo_end_stroke(undoBuf, target->layer);
+			cpart_free(target);
+			paintedStrokes++;
+		}
+	if (undoBuf)
+		undo_collect(undoBuf);
+	// once every previewed stroke is painted in full, clear the preview.
+	if (previewShown && !penIsDown && paintedStrokes == sentStrokes) {
+		// the preview worker passes each stroke on after queueing its
+		// preview, which may have arrived since the drain above.
+		while (paintworker_drain(previewWorker, paint_preview, 0)) {}
+		size_preview(previewScale);
+		show_preview(false);
+	}
+}
+
+static unsigned long app_idle(void* data) {
+	merge_paint();
+	return timer_run(data);
+}
+
+void finish_painting() {
+	// wait for the workers to paint every stroke sent so far.
+	while (paintWorker && paintedStrokes != sentStrokes) {
+		merge_paint();
+		thread_yield();
+	}
+}
+
 static void flush_output(void* data, timer_t* timer) {
 	if (needCommit && scrollView) {
 		ui_commit_window(scrollView);
@@ -474,7 +602,7 @@ static void flush_output(void* data, timer_t* timer) {
 void init()
 {
 	app_heap_check();
-    app_set_scheduler(timer_run, 0);
+    app_set_scheduler(app_idle, 0);
 
     mainWnd = ui_create_app_window("Skunkpad", main_handler, 0);
     scrollView = ui_create_scroll_view(mainWnd, scroll_handler, 0);
@@ -487,11 +615,21 @@ void init()
 	// must create the painter before scene init and before
 	// any tablet events can arrive [too many global deps!]
     painter = createDabPainter(gfxDraw);
-	painter_set_output(painter, paint_output, 0);
 
 	{stringref file = str_lit("round_brush.png");
-	load_image_sd(file, &brush, false);
-	painter_set_brush(painter, &brush);}
+	if (load_image_sd(file, &brush, false))
+		painter_set_brush(painter, &brush);}
+
+	// rasterize on a worker so input is never held up by painting,
+	// with another in front of it to preview strokes when zoomed out.
+	paintWorker = paintworker_create(painter, 0);
+	previewPainter = createDabPainter(gfxDraw);
+	if (surfaceValid(&brush))
+		painter_set_brush(previewPainter, &brush);
+	previewWorker = paintworker_create(previewPainter, paintWorker);
+	// record strokes from the front of the chain, for replay.
+	strokeLog = strokelog_create();
+	paintworker_set_log(previewWorker, strokeLog);
 
     // make the background shown when no document is loaded.
     g_root_frame = frame_create_box(0);
@@ -503,7 +641,9 @@ void init()
 
     scaledView.zoom = 100*120;
 
-    undoBuf = undobuf_create(50 * 1024 * 1024); // 50 Mb.
+    undoBuf = undo_create(50 * 1024 * 1024); // 50 Mb.
+	// older strokes go to a scratch file, mapped a few Mb at a time.
+	undo_set_spill(undoBuf, 1024 * 1024 * 1024); // 1 Gb.
 
     init_bindings();
 
@@ -518,6 +658,12 @@ void run() {}
 void final()
 {
     if (tablet) tablet_input_destroy(tablet);
+	// the preview worker feeds the paint worker, so goes first.
+	if (previewWorker) paintworker_destroy(previewWorker);
+	if (paintWorker) paintworker_destroy(paintWorker);
+	if (strokeLog) strokelog_destroy(strokeLog);
+	// the history refers to layers, so goes before them.
+	if (undoBuf) undo_destroy(undoBuf);
     term_bindings();
 	frame_destroy(g_root_frame);
 	g_root_frame = 0;
@@ -546,8 +692,11 @@ Frame* get_layer(int index)
 
 static void no_active_layer()
 {
+    drop_preview();
     activeLayer = 0;
     activeLayerIndex = 0;
+    if (document)
+        document->layers->message(document->layers, frameSetActive, 0);
 }
 
 static void no_document()
@@ -564,6 +713,11 @@ void close_doc()
     iPair org = {0,0};
     // free all document memory.
     if (document) {
+        // the preview is drawn by the canvas.
+        drop_preview();
+        // the history refers to the layers.
+        finish_painting();
+        undo_clear(undoBuf);
         // free all layers.
         destroy_frame(document->layers);
         document->layers = 0;
@@ -588,6 +742,8 @@ void new_doc(int width, int height)
     document->width = width;
     document->height = height;
     document->paper = rgba_white;
+    // the log replays onto a blank document.
+    strokelog_clear(strokeLog);
     // create the canvas frame.
     document->layers = frame_create_canvas(g_root_frame);
     frame_set_size(document->layers, width, height);
@@ -613,8 +769,14 @@ void new_layer(int above)
 		// TODO: frames should belong to a FrameScene with a GfxContext.
 		layer->message(layer, frameSetRenderContext, gfxContext);
         frame_set_size(layer, document->width, document->height);
+        // keep the tiles each stroke replaces, for undo.
+        {bool keep = true;
+        layer->message(layer, frameKeepTiles, &keep);}
         if (above >= 0)
             insert_frame(layer, document->layers, above); // change Z order.
+        // after the strokes in flight, in the history.
+        finish_painting();
+        undo_insert_layer(undoBuf, layer);
     }
 }
 
@@ -626,12 +788,19 @@ void delete_layer(int index)
         // clear selection if layer is selected.
         if (layer == activeLayer)
             no_active_layer();
-        // destroy the layer.
-        // TODO: move to undo buffer instead.
-        destroy_frame(layer);
+        // the history keeps the layer until it can no longer be undone.
+        finish_painting();
+        undo_delete_layer(undoBuf, layer);
     }
 }
 
+void remove_layer(Frame* layer)
+{
+    if (layer == activeLayer)
+        no_active_layer();
+    frame_remove(layer);
+}
+
 void load_into_layer(int index, stringref path)
 {
     Frame* layer = get_layer(index);
@@ -644,6 +813,18 @@ void load_into_layer(int index, stringref path)
     }
 }
 
+void save_stroke_log(stringref path)
+{
+    // strokes painted since the document was created, for replay.
+    size_t size;
+    const byte* data = strokelog_data(strokeLog, &size);
+    FILE* fp = fopen(strr_cstr(path), "wb");
+    if (fp) {
+        fwrite(data, 1, size, fp);
+        fclose(fp);
+    }
+}
+
 GfxImage load_image(stringref path) //, bool premultiply)
 {
     SurfaceData sd = {0};
@@ -718,25 +899,41 @@ void invalidate_all()
 void set_brush_mode(BlendMode mode)
 {
 	brushMode = mode;
+	// strokes take the mode as they begin, so it is only logged.
+	if (strokeLog) strokelog_set_mode(strokeLog, mode);
 }
 
 void set_brush_size(int sizeMin, int sizeMax, int spacing) // Q8
 {
-    if (sizeMin > 255*256) sizeMin = 255*256;
-    if (sizeMax > 255*256) sizeMax = 255*256;
-    if (spacing > 255*256) spacing = 255*256;
-    painter_set_size_range(painter, sizeMin, sizeMax);
-	painter_set_spacing(painter, spacing);
+    // large brushes are painted at reduced resolution.
+    if (sizeMin > 4096*256) sizeMin = 4096*256;
+    if (sizeMax > 4096*256) sizeMax = 4096*256;
+    if (spacing > 4096*256) spacing = 4096*256;
+    paintworker_set_size(previewWorker, sizeMin, sizeMax, spacing);
 }
 
 void set_brush_alpha(int alphaMin, int alphaMax) // Q8
 {
-    painter_set_alpha_range(painter, alphaMin, alphaMax);
+    paintworker_set_alpha(previewWorker, alphaMin, alphaMax);
 }
 
 void set_brush_col(RGBA col)
 {
-    painter_set_colour(painter, col);
+    paintworker_set_colour(previewWorker, col);
+}
+
+void set_brush_symmetry(int mode, int n, float x, float y)
+{
+    if (document && (x < 0 || y < 0)) {
+        x = document->width * 0.5f;
+        y = document->height * 0.5f;
+    }
+    paintworker_set_symmetry(previewWorker, (PainterSymmetry)mode, n, x, y);
+}
+
+void set_brush_smoothing(bool smooth)
+{
+    paintworker_set_smoothing(previewWorker, smooth);
 }
 
 void begin_painting()
@@ -747,10 +944,14 @@ void begin_painting()
 void active_layer(int index)
 {
     Frame* layer = get_layer(index);
+    // the preview of strokes in flight belongs to the old layer.
+    finish_painting();
     // select new layer for drawing.
     if (layer) {
         activeLayer = layer;
         activeLayerIndex = index;
+        // the canvas flattens the layers either side of it.
+        document->layers->message(document->layers, frameSetActive, layer);
     } else no_active_layer();
 }
 
@@ -16,11 +16,16 @@ void new_layer(int above);
 void delete_layer(int index);
 void show_layer(int index, bool show);
 void load_into_layer(int index, stringref path);
+void save_stroke_log(stringref path);
 void active_layer(int index); // for painting.
 void set_brush_mode(BlendMode mode);
 void set_brush_size(int sizeMin, int sizeMax, int spacing);
 void set_brush_alpha(int alphaMin, int alphaMax);
 void set_brush_col(RGBA col);
+// mode: PainterSymmetry; about the document centre if x or y < 0.
+void set_brush_symmetry(int mode, int n, float x, float y);
+// smooth strokes through the pen samples, from the next stroke.
+void set_brush_smoothing(bool smooth);
 void begin_painting();
 void invalidate_all();
 void zoom(int steps);
@@ -58,31 +63,77 @@ void set_frame_shape(int frame, float radius); // non-zero for round rect.
 
 // undo
 
+// a fixed size ring of packets, each one undo step. packets are built
+// in place: begin, reserve space and fill it, commit, end. the oldest
+// packets are discarded to make room. undo and redo hand func the
+// newest applied packet, or the next undone one; undone packets can be
+// redone until the next begin.
 typedef struct UndoBuffer UndoBuffer;
 typedef void (*UndoBufferApply)(void* obj, void* data, int size);
 UndoBuffer* undobuf_create(size_t size);
-void undobuf_resize(UndoBuffer* ub, size_t size);
+// in a mapped scratch file, or 0 if it cannot be created; up to 2GB.
+UndoBuffer* undobuf_create_mapped(size_t size);
+void undobuf_destroy(UndoBuffer* ub);
+void undobuf_resize(UndoBuffer* ub, size_t size); // clears the buffer.
+void undobuf_clear(UndoBuffer* ub);
+// func is called on each packet as it is discarded.
+void undobuf_set_discard(UndoBuffer* ub, UndoBufferApply func, void* obj);
+// func is called instead on each packet discarded to make room.
+void undobuf_set_evict(UndoBuffer* ub, UndoBufferApply func, void* obj);
 void undobuf_begin(UndoBuffer* ub, void* data, int size); // begin a packet.
+// space for size more bytes in the packet, or 0 if the packet would not
+// fit in the buffer; valid until the next reserve.
+void* undobuf_reserve(UndoBuffer* ub, int size);
+void undobuf_commit(UndoBuffer* ub, int size); // bytes of the reservation used.
 void undobuf_append(UndoBuffer* ub, void* data, int size); // append to packet.
 void undobuf_end(UndoBuffer* ub); // end of current packet.
-void undobuf_undo(UndoBuffer* ub, UndoBufferApply func, void* obj);
-void undobuf_redo(UndoBuffer* ub, UndoBufferApply func, void* obj);
+void undobuf_cancel(UndoBuffer* ub); // drop the current packet.
+bool undobuf_undo(UndoBuffer* ub, UndoBufferApply func, void* obj);
+bool undobuf_redo(UndoBuffer* ub, UndoBufferApply func, void* obj);
+// discard the oldest packet, if it has not been undone.
+bool undobuf_drop_oldest(UndoBuffer* ub);
+// discard the undone packets, as the next begin would.
+void undobuf_drop_redo(UndoBuffer* ub);
 
+// stroke history, in an UndoBuffer of size bytes.
+UndoBuffer* undo_create(size_t size);
+void undo_destroy(UndoBuffer* ub);
+// spill strokes evicted from the history to a scratch file of size
+// bytes, to undo further back; 0 turns it off.
+void undo_set_spill(UndoBuffer* ub, size_t size);
 void undo(UndoBuffer* ub);
 void redo(UndoBuffer* ub);
+// record the tiles the layer kept since the last stroke ended.
+void undo_end_stroke(UndoBuffer* ub, Frame* layer);
+// strokes are compressed on a worker: record those it has finished,
+// or wait for them all.
+void undo_collect(UndoBuffer* ub);
+void undo_flush(UndoBuffer* ub);
+// record a layer just inserted, or take one out of the document; the
+// history destroys it once the deletion can no longer be undone.
+void undo_insert_layer(UndoBuffer* ub, Frame* layer);
+void undo_delete_layer(UndoBuffer* ub, Frame* layer);
+// forget the whole history, e.g. when its layers are destroyed.
+void undo_clear(UndoBuffer* ub);
 
 // app stuff that undo uses...
 extern Frame* activeLayer;
+// take a layer out of the document without destroying it.
+void remove_layer(Frame* layer);
 void update_brush();
+// merge all paint in flight, recording each stroke.
+void finish_painting();
 
 
 // brush engine.
 struct Tablet_InputEvent;
 typedef struct DabPainter DabPainter;
 // merge deferred painting into the document.
+// image: pre-multiplied surface_rgba16, or surface_a16 coverage of col.
 // org: top-left corner of source rect (size from bounds)
 // bounds: destination rect in document space.
-typedef void (*DabPainterOutput)(void* obj, SurfaceData* image, iPair org, iRect bounds);
+typedef void (*DabPainterOutput)(void* obj, SurfaceData* image, RGBA col, iPair org, iRect bounds);
+// draw may be 0: paint only leaves the painter through its output.
 DabPainter* createDabPainter(GfxDraw draw);
 //void painter_set_context(DabPainter* dp, GfxContext cx);
 void painter_begin(DabPainter* dp, struct Tablet_InputEvent* e);
@@ -90,20 +141,117 @@ void painter_begin_batch(DabPainter* dp);
 void painter_draw(DabPainter* dp, struct Tablet_InputEvent* e);
 void painter_end_batch(DabPainter* dp);
 void painter_end(DabPainter* dp);
+// set a surface_a8 brush shape, or 0 for round dabs.
+// the brush is prefiltered and copied; the caller keeps ownership.
 void painter_set_brush(DabPainter* dp, SurfaceData* brush);
 void painter_set_colour(DabPainter* dp, RGBA col);
+// accumulate 16-bit coverage of the colour instead of rgba16 colour,
+// for a quarter of the memory traffic; takes effect from the next stroke.
+void painter_set_coverage(DabPainter* dp, bool coverage);
 void painter_set_alpha_range(DabPainter* dp, int min, int max);
 // specify minimum and maximum brush size in Q8 document coords.
 // the brush shape is always square for now.
 void painter_set_size_range(DabPainter* dp, int min, int max);
 // specify dab spacing in Q8 document coords.
 void painter_set_spacing(DabPainter* dp, int ratio);
+// smooth strokes through the input samples (Catmull-Rom).
+// takes effect from the next stroke; adds one sample of latency.
+void painter_set_smoothing(DabPainter* dp, bool smooth);
+// paint at 1/2^scale of document resolution, for a preview; output
+// bounds are in reduced pixels. takes effect from the next stroke.
+void painter_set_preview(DabPainter* dp, int scale);
+// paint each dab n times about (x,y) in document coords: mirrored in
+// x, rotated n ways (up to 16), or rotated and mirrored; the copies
+// are merged together. brush shapes are not rotated.
+typedef enum PainterSymmetry {
+	symmetryNone,
+	symmetryMirror,
+	symmetryRadial,
+	symmetryKaleidoscope,
+} PainterSymmetry;
+void painter_set_symmetry(DabPainter* dp, PainterSymmetry mode, int n, float x, float y);
 // set a callback that will merge deferred paint into the document.
 void painter_set_output(DabPainter* dp, DabPainterOutput func, void* obj);
+// instead of merging on flush, hand each full accumulator to func and
+// keep painting into another; buf must be passed to painter_merge
+// (on any thread) in the order submitted.
+typedef struct PainterBuffer PainterBuffer;
+typedef void (*DabPainterSubmit)(void* obj, PainterBuffer* buf);
+void painter_set_submit(DabPainter* dp, DabPainterSubmit func, void* obj);
+void painter_merge(PainterBuffer* buf, DabPainterOutput func, void* obj);
+// counts since the painter was created, for benchmarks.
+typedef struct PainterStats {
+	int dabs;		// dabs painted, including symmetric copies.
+	int flushes;	// accumulators merged or submitted.
+} PainterStats;
+void painter_get_stats(DabPainter* dp, PainterStats* stats);
+// input pressure in [0,1] as the painter sees it: Q16, clamped.
+#define PAINTER_PRESSURE_ONE 65536
+int painter_quantize_pressure(double pressure);
 //GfxImage painter_get_accum(DabPainter* dp);
 //RGBA painter_get_col(DabPainter* dp);
 
 
+// raster worker.
+// runs a DabPainter on its own thread; commands are queued from the
+// input thread and never wait for rasterization.
+typedef struct PaintWorker PaintWorker;
+// takes over dp; with next, dp paints previews and every command is
+// passed on to next.
+PaintWorker* paintworker_create(DabPainter* dp, PaintWorker* next);
+void paintworker_destroy(PaintWorker* pw);
+// target is handed back with the stroke's paint, see paintworker_drain.
+void paintworker_begin(PaintWorker* pw, struct Tablet_InputEvent* e, void* target);
+void paintworker_draw(PaintWorker* pw, struct Tablet_InputEvent* e);
+void paintworker_end(PaintWorker* pw);
+void paintworker_begin_batch(PaintWorker* pw);
+void paintworker_end_batch(PaintWorker* pw);
+void paintworker_set_colour(PaintWorker* pw, RGBA col);
+void paintworker_set_size(PaintWorker* pw, int min, int max, int spacing);
+void paintworker_set_alpha(PaintWorker* pw, int min, int max);
+void paintworker_set_symmetry(PaintWorker* pw, PainterSymmetry mode, int n, float x, float y);
+void paintworker_set_smoothing(PaintWorker* pw, bool smooth);
+// preview the next stroke at 1/2^scale resolution, or not if 0.
+void paintworker_set_preview(PaintWorker* pw, int scale);
+// record every command sent to the worker into log, or stop if 0.
+typedef struct StrokeLog StrokeLog;
+void paintworker_set_log(PaintWorker* pw, StrokeLog* log);
+// main thread: merge finished regions through func, passing the target
+// given to paintworker_begin for their stroke; returns true if it
+// stopped at the end of a stroke, with its target in *target (if not 0),
+// false once empty.
+bool paintworker_drain(PaintWorker* pw, DabPainterOutput func, void** target);
+
+
+// stroke log.
+// records painter commands compactly as they are issued; replaying a
+// log into a fresh DabPainter reproduces the same dabs exactly, with no
+// window or worker, for bug reports and benchmarks.
+StrokeLog* strokelog_create();
+void strokelog_destroy(StrokeLog* log);
+// empty the log; it starts again with the current brush state.
+void strokelog_clear(StrokeLog* log);
+const byte* strokelog_data(StrokeLog* log, size_t* size);
+void strokelog_begin(StrokeLog* log, struct Tablet_InputEvent* e);
+void strokelog_draw(StrokeLog* log, struct Tablet_InputEvent* e);
+void strokelog_end(StrokeLog* log);
+void strokelog_begin_batch(StrokeLog* log);
+void strokelog_end_batch(StrokeLog* log);
+void strokelog_set_colour(StrokeLog* log, RGBA col);
+void strokelog_set_size(StrokeLog* log, int min, int max, int spacing);
+void strokelog_set_alpha(StrokeLog* log, int min, int max);
+void strokelog_set_symmetry(StrokeLog* log, PainterSymmetry mode, int n, float x, float y);
+void strokelog_set_smoothing(StrokeLog* log, bool smooth);
+// the mode strokes are merged with; not painter state (see StrokeTarget).
+void strokelog_set_mode(StrokeLog* log, BlendMode mode);
+// drive dp from a recorded log on the calling thread; dp's output
+// receives the paint, and should merge it with *mode, which is set as
+// each stroke begins (mode may be 0). returns the number of strokes,
+// or -1 if the log is malformed (strokes up to that point are still
+// painted).
+int strokelog_replay(const byte* data, size_t size, DabPainter* dp, BlendMode* mode);
+
+
 // bindings
 void init_bindings();
 void term_bindings();
@@ -0,0 +1,379 @@
+#include "defs.h"
+#include "surface.h"
+#include "tablet_input.h"  // for Tablet_InputEvent protocol.
+#include "skunkpad.h"
+
+// Records painter input as a compact byte stream, and replays it into
+// a DabPainter with no window, worker or GPU involved.
+
+// Each record is an opcode byte followed by varints. Samples are stored
+// as they are quantized by the painter (Q8 position, Q16 pressure) and
+// all but the first of a stroke as deltas from the previous one, so a
+// typical sample takes 4-6 bytes and replays exactly. Brush state is
+// recorded as it changes, and repeated at the start of a cleared log so
+// every log replays from a known state.
+
+typedef enum log_ops {
+	op_begin = 1,	// x, y, pressure, tilt, buttons.
+	op_draw,		// deltas of the above; see log_flags.
+	op_end,
+	op_begin_batch,
+	op_end_batch,
+	op_colour,		// r, g, b, a bytes.
+	op_size,		// min, max, spacing.
+	op_alpha,		// min, max.
+	op_symmetry,	// mode, n, Q8 x, Q8 y.
+	op_smoothing,	// 0 or 1.
+	op_mode,		// BlendMode of the strokes begun after it.
+} log_ops;
+
+typedef enum log_flags {
+	flag_tilt = 0x40,		// op_draw: tilt delta follows.
+	flag_buttons = 0x80,	// op_draw: buttons follow.
+	flag_mask = 0xC0,
+} log_flags;
+
+typedef struct LogSample {
+	int x, y, pressure, tilt, buttons;
+} LogSample;
+
+struct StrokeLog {
+	byte* data;
+	size_t size, alloc;
+	LogSample last;		// previous sample, for deltas.
+	// brush state, repeated when the log is cleared.
+	RGBA col;
+	int size_min, size_max, spacing;
+	int alpha_min, alpha_max;
+	int sym_mode, sym_n, sym_x, sym_y;
+	int smooth;
+	int mode;
+};
+
+// worst case: an opcode and five 5-byte varints.
+#define LOG_RECORD_MAX (1 + 5*5)
+
+static void log_reserve(StrokeLog* log, size_t len)
+{
+	if (log->size + len > log->alloc) {
+		log->alloc = log->alloc ? log->alloc * 2 : 4096;
+		if (log->alloc < log->size + len) log->alloc = log->size + len;
+		log->data = realloc(log->data, log->alloc);
+	}
+}
+
+static void log_num(StrokeLog* log, int val)
+{
+	// zig-zag sign into the lowest bit, then 7 bits per byte.
+	unsigned int bits = (val < 0) ? ((((unsigned int)-val) << 1) | 1) : ((unsigned int)val << 1);
+	while (bits >> 7) {
+		log->data[log->size++] = (byte)(0x80 | (bits & 0x7F));
+		bits >>= 7;
+	}
+	log->data[log->size++] = (byte)bits;
+}
+
+static void log_op(StrokeLog* log, int op)
+{
+	log_reserve(log, LOG_RECORD_MAX);
+	log->data[log->size++] = (byte)op;
+}
+
+static void log_quantize(Tablet_InputEvent* e, LogSample* s)
+{
+	// must match painter_sample.
+	s->x = (int)(e->x * 256);
+	s->y = (int)(e->y * 256);
+	s->pressure = painter_quantize_pressure(e->pressure);
+	s->tilt = (int)(e->tilt * 256);
+	s->buttons = e->buttons;
+}
+
+static void log_state(StrokeLog* log)
+{
+	// record the whole brush state.
+	log_op(log, op_colour);
+	log->data[log->size++] = log->col.r;
+	log->data[log->size++] = log->col.g;
+	log->data[log->size++] = log->col.b;
+	log->data[log->size++] = log->col.a;
+	log_op(log, op_size);
+	log_num(log, log->size_min);
+	log_num(log, log->size_max);
+	log_num(log, log->spacing);
+	log_op(log, op_alpha);
+	log_num(log, log->alpha_min);
+	log_num(log, log->alpha_max);
+	log_op(log, op_symmetry);
+	log_num(log, log->sym_mode);
+	log_num(log, log->sym_n);
+	log_num(log, log->sym_x);
+	log_num(log, log->sym_y);
+	log_op(log, op_smoothing);
+	log_num(log, log->smooth);
+	log_op(log, op_mode);
+	log_num(log, log->mode);
+}
+
+StrokeLog* strokelog_create()
+{
+	StrokeLog* log = cpart_new(StrokeLog);
+	// the painter's initial state; the colour starts zeroed.
+	log->size_min = log->size_max = 256;
+	log->spacing = 256 / 10;
+	log->alpha_min = 0;
+	log->alpha_max = 255;
+	log->sym_mode = symmetryNone;
+	log->sym_n = 1;
+	log->smooth = 0;
+	log->mode = blendNormal;
+	strokelog_clear(log);
+	return log;
+}
+
+void strokelog_destroy(StrokeLog* log)
+{
+	free(log->data);
+	cpart_free(log);
+}
+
+void strokelog_clear(StrokeLog* log)
+{
+	log->size = 0;
+	log_state(log);
+}
+
+const byte* strokelog_data(StrokeLog* log, size_t* size)
+{
+	*size = log->size;
+	return log->data;
+}
+
+void strokelog_begin(StrokeLog* log, Tablet_InputEvent* e)
+{
+	LogSample s;
+	log_quantize(e, &s);
+	log_op(log, op_begin);
+	log_num(log, s.x);
+	log_num(log, s.y);
+	log_num(log, s.pressure);
+	log_num(log, s.tilt);
+	log_num(log, s.buttons);
+	log->last = s;
+}
+
+void strokelog_draw(StrokeLog* log, Tablet_InputEvent* e)
+{
+	LogSample s;
+	int op = op_draw;
+	log_quantize(e, &s);
+	if (s.tilt != log->last.tilt) op |= flag_tilt;
+	if (s.buttons != log->last.buttons) op |= flag_buttons;
+	log_op(log, op);
+	log_num(log, s.x - log->last.x);
+	log_num(log, s.y - log->last.y);
+	log_num(log, s.pressure - log->last.pressure);
+	if (op & flag_tilt) log_num(log, s.tilt - log->last.tilt);
+	if (op & flag_buttons) log_num(log, s.buttons);
+	log->last = s;
+}
+
+void strokelog_end(StrokeLog* log) { log_op(log, op_end); }
+void strokelog_begin_batch(StrokeLog* log) { log_op(log, op_begin_batch); }
+void strokelog_end_batch(StrokeLog* log) { log_op(log, op_end_batch); }
+
+void strokelog_set_colour(StrokeLog* log, RGBA col)
+{
+	log->col = col;
+	log_op(log, op_colour);
+	log->data[log->size++] = col.r;
+	log->data[log->size++] = col.g;
+	log->data[log->size++] = col.b;
+	log->data[log->size++] = col.a;
+}
+
+void strokelog_set_size(StrokeLog* log, int min, int max, int spacing)
+{
+	log->size_min = min; log->size_max = max; log->spacing = spacing;
+	log_op(log, op_size);
+	log_num(log, min);
+	log_num(log, max);
+	log_num(log, spacing);
+}
+
+void strokelog_set_alpha(StrokeLog* log, int min, int max)
+{
+	log->alpha_min = min; log->alpha_max = max;
+	log_op(log, op_alpha);
+	log_num(log, min);
+	log_num(log, max);
+}
+
+void strokelog_set_symmetry(StrokeLog* log, PainterSymmetry mode, int n, float x, float y)
+{
+	log->sym_mode = mode; log->sym_n = n;
+	log->sym_x = (int)(x * 256); log->sym_y = (int)(y * 256);
+	log_op(log, op_symmetry);
+	log_num(log, log->sym_mode);
+	log_num(log, log->sym_n);
+	log_num(log, log->sym_x);
+	log_num(log, log->sym_y);
+}
+
+void strokelog_set_smoothing(StrokeLog* log, bool smooth)
+{
+	log->smooth = smooth ? 1 : 0;
+	log_op(log, op_smoothing);
+	log_num(log, log->smooth);
+}
+
+void strokelog_set_mode(StrokeLog* log, BlendMode mode)
+{
+	log->mode = mode;
+	log_op(log, op_mode);
+	log_num(log, log->mode);
+}
+
+
+// replay.
+
+typedef struct LogReader {
+	const byte* p;
+	const byte* end;
+	bool bad;
+} LogReader;
+
+static int read_num(LogReader* r)
+{
+	unsigned int bits = 0, val;
+	int shift = 0;
+	do {
+		if (r->p == r->end || shift > 28) {
+			r->bad = true;
+			return 0;
+		}
+		val = *r->p++;
+		bits |= (val & 0x7F) << shift;
+		shift += 7;
+	} while (val & 0x80);
+	return (bits & 1) ? -(int)(bits >> 1) : (int)(bits >> 1);
+}
+
+static int read_byte(LogReader* r)
+{
+	if (r->p == r->end) {
+		r->bad = true;
+		return 0;
+	}
+	return *r->p++;
+}
+
+static void read_event(const LogSample* s, Tablet_InputEvent* e)
+{
+	// exact: the painter quantizes these back to the same values.
+	e->event = tablet_event_input;
+	e->x = s->x / 256.0;
+	e->y = s->y / 256.0;
+	e->pressure = s->pressure / (double)PAINTER_PRESSURE_ONE;
+	e->tilt = s->tilt / 256.0f;
+	e->rotation = 0;
+	e->buttons = s->buttons;
+}
+
+int strokelog_replay(const byte* data, size_t size, DabPainter* dp, BlendMode* mode)
+{
+	LogReader r;
+	LogSample s = {0};
+	Tablet_InputEvent e;
+	int strokes = 0;
+	bool down = false;
+	BlendMode next = blendNormal;
+
+	r.p = data;
+	r.end = data + size;
+	r.bad = false;
+
+	while (r.p < r.end && !r.bad)
+	{
+		int op = *r.p++;
+		switch (op & ~flag_mask)
+		{
+		case op_begin:
+			s.x = read_num(&r);
+			s.y = read_num(&r);
+			s.pressure = read_num(&r);
+			s.tilt = read_num(&r);
+			s.buttons = read_num(&r);
+			if (r.bad) break;
+			read_event(&s, &e);
+			// as in the app, a stroke keeps the mode it began with; the
+			// last stroke was merged as it ended.
+			if (mode) *mode = next;
+			painter_begin(dp, &e);
+			down = true;
+			break;
+		case op_draw:
+			s.x += read_num(&r);
+			s.y += read_num(&r);
+			s.pressure += read_num(&r);
+			if (op & flag_tilt) s.tilt += read_num(&r);
+			if (op & flag_buttons) s.buttons = read_num(&r);
+			if (r.bad || !down) break;
+			read_event(&s, &e);
+			painter_draw(dp, &e);
+			break;
+		case op_end:
+			if (!down) break;
+			painter_end(dp);
+			down = false;
+			strokes++;
+			break;
+		case op_begin_batch:
+			painter_begin_batch(dp);
+			break;
+		case op_end_batch:
+			painter_end_batch(dp);
+			break;
+		case op_colour: {
+			RGBA col;
+			col.r = read_byte(&r); col.g = read_byte(&r);
+			col.b = read_byte(&r); col.a = read_byte(&r);
+			if (!r.bad) painter_set_colour(dp, col);
+			break; }
+		case op_size: {
+			int min = read_num(&r), max = read_num(&r), spacing = read_num(&r);
+			if (r.bad) break;
+			painter_set_size_range(dp, min, max);
+			painter_set_spacing(dp, spacing);
+			break; }
+		case op_alpha: {
+			int min = read_num(&r), max = read_num(&r);
+			if (!r.bad) painter_set_alpha_range(dp, min, max);
+			break; }
+		case op_symmetry: {
+			int mode = read_num(&r), n = read_num(&r);
+			int x = read_num(&r), y = read_num(&r);
+			if (!r.bad)
+				painter_set_symmetry(dp, (PainterSymmetry)mode, n, x / 256.0f, y / 256.0f);
+			break; }
+		case op_smoothing: {
+			int smooth = read_num(&r);
+			if (!r.bad) painter_set_smoothing(dp, smooth ? true : false);
+			break; }
+		case op_mode: {
+			int m = read_num(&r);
+			if (!r.bad) next = (BlendMode)m;
+			break; }
+		default:
+			r.bad = true;
+			break;
+		}
+	}
+
+	// a log cut short (e.g. by a crash) still ends its last stroke.
+	if (down) {
+		painter_end(dp);
+		strokes++;
+	}
+	return r.bad ? -1 : strokes;
+}
@@ -1,360 +1,875 @@
 #include "defs.h"
 #include "surface.h"
-#include "pagebuf.h"
+#include "frames.h"
+#include "graphics.h"
 #include "skunkpad.h"
+#include "app.h"
+#include "thread.h"
+#include "spscring.h"
+#include "filemap.h"
 
 // Design:
-// fixed size circular buffer.
-// the insert "pos" is always immediately beyond the last record (init zero)
-// each record begins with the (circular) distance from the previous record.
-// a record encodes its own type and size.
-
-// sentinel record: the last valid record is tagged "end" (overwritten
-// when appending) so the "active" record is always valid.
-
-// active record: "active" always holds the offset of the active record;
-// undo never applies the active record; redo always applies it;
-// append overwrites the active record and also 
-
-// ready to append: the "active" record is the insertion point, but may
-// be a valid record to "redo"; thus it is also the latest record undone.
+// fixed size circular buffer of packets, each one undo step.
+// each packet is contiguous, and begins with a header giving its size
+// and the offset of the previous packet; a packet that would cross the
+// end of the buffer starts again at zero, leaving a zero-size header
+// (or less room than a header) behind to mark the wrap.
 
 // appending: [this is the fast path]
-// determine pos for new record of size; set begin, copy to eobuf.
-// set prev to new pos - last pos; set last pos to new pos.
-// advance the insert pos to end of new record.
-// let caller populate the new record.
-
-// undo:
-// if no records, stop.
-// do {
-// - apply its undo logic,
-// - using its prev, rewind begin pos (wrap around)
-// } while the record at begin pos is not undo-stop flagged,
-// finally, request size of record at begin and update insert.
-
-// redo:
-// if no records, stop.
-// do {
-// - apply record redo logic, returning size.
-// - using size, advance begin pos to next record (wrap around)
-// } while the record at begin pos is not redo-stop flagged,
-// finally, request size of record at begin and update insert.
+// begin a packet at the end of the newest, then reserve space and fill
+// it in place. when the packet would run into the oldest packet, the
+// oldest are discarded until it fits; when it would run off the end of
+// the buffer, the packet so far is moved to the start.
+
+// undo hands the newest applied packet to the caller and steps back to
+// its previous packet; redo steps forward to the next packet and hands
+// it over. undone packets stay valid until the next packet begins.
+// all of these are O(1) in the number of packets.
+
+// a buffer can also live in a scratch file, so it can hold far more
+// than stays resident. only a few MB of the file are mapped at a time,
+// and packets are read and written in place through that window, which
+// moves to each packet as it is used. the stroke history keeps one as a
+// second tier: packets it evicts to make room are appended to the file
+// instead of being lost.
+
+typedef struct UndoPacket {
+	int size;   // total bytes including header, a multiple of 8; 0 marks a wrap.
+	int len;    // payload bytes.
+	int prev;   // offset of the previous packet.
+	int unused;
+} UndoPacket;
+
+#define PACKET(UB,POS) ((UndoPacket*)buf_at((UB), (POS), sizeof(UndoPacket)))
+#define ALIGN8(N) (((N) + 7) & ~7)
+
+// the part of a mapped buffer's file that is mapped at a time.
+static const size_t c_mapWindow = 4 * 1024 * 1024;
 
 struct UndoBuffer {
-	byte* buf;      // undo records.
-	size_t insert;  // insert pos; end of active record.
-	size_t active;  // beginning of active record.
-	size_t eobuf;   // beginning of last valid (redo) record.
-	size_t bufsize; // total size of undo buffer.
+	byte* buf;      // undo packets; 0 if mapped.
+	int bufsize;    // total size of undo buffer, a multiple of 8.
+	int count;      // packets in the buffer.
+	int applied;    // packets not undone; the rest can be redone.
+	int first;      // oldest packet.
+	int last;       // newest applied packet, if any.
+	int end;        // end of the newest packet.
+	int open;       // packet being built, or -1.
+	int len;        // bytes in the open packet, including header.
+	int reserved;   // bytes reserved beyond len.
+	UndoBufferApply discard;
+	void* discardObj;
+	UndoBufferApply evict;  // instead of discard, for packets dropped to make room.
+	void* evictObj;
+	FileMap* map;   // the file holding the packets, if mapped.
+	// stroke history.
+	Thread* thread;     // compresses finished strokes.
+	ThreadSignal* wake;
+	SpscRing* jobs;     // UndoJob* to compress; 0 to quit.
+	SpscRing* done;     // compressed UndoJob*, in order.
+	int pending;        // jobs not yet recorded.
+	SurfaceData sd;     // a tile's pixels, as a stroke is applied.
+	UndoBuffer* spill;  // strokes evicted from this buffer, older than all of its own.
 };
 
-typedef enum undo_tags {
-	tag_end=0,
-	tag_brush,
-	tag_sample,
-	tag_rect,
-} undo_tags;
-
-typedef struct record record;
-struct record {
-	uint16 prev;     // circular offset from beginning of prev record.
-	byte tag, info;  // tag type of record, record-specific info.
-};
+static byte* buf_at(UndoBuffer* ub, int pos, int len)
+{
+	// in a mapped buffer, only good until the next call.
+	if (ub->map)
+		return filemap_view(ub->map, pos, len);
+	return ub->buf + pos;
+}
+
+static UndoPacket* whole_packet(UndoBuffer* ub, int pos)
+{
+	// the header with its payload; 0 if it cannot be mapped.
+	return (UndoPacket*)buf_at(ub, pos, PACKET(ub, pos)->size);
+}
+
+static void move_open(UndoBuffer* ub)
+{
+	// move the open packet to the start of the buffer; it can overlap
+	// itself, so a mapped buffer copies in steps from the front.
+	byte step[512];
+	int done, n;
+	if (!ub->map) {
+		memmove(ub->buf, ub->buf + ub->open, ub->len);
+		return;
+	}
+	for (done = 0; done < ub->len; done += n) {
+		n = ub->len - done;
+		if (n > (int)sizeof(step))
+			n = sizeof(step);
+		memcpy(step, buf_at(ub, ub->open + done, n), n);
+		memcpy(buf_at(ub, done, n), step, n);
+	}
+}
+
+static int next_packet(UndoBuffer* ub, int pos)
+{
+	int next = pos + PACKET(ub, pos)->size;
+	if (next + (int)sizeof(UndoPacket) > ub->bufsize || !PACKET(ub, next)->size)
+		next = 0; // wrapped.
+	return next;
+}
+
+static void discard_packet(UndoBuffer* ub, int pos)
+{
+	UndoPacket* p;
+	if (ub->discard) {
+		p = whole_packet(ub, pos);
+		if (p)
+			ub->discard(ub->discardObj, p + 1, p->len);
+	}
+}
+
+static void drop_redo(UndoBuffer* ub)
+{
+	// undone packets can only be redone until the next packet begins.
+	int pos = ub->applied ? ub->last : -1;
+	while (ub->count > ub->applied) {
+		pos = (pos < 0) ? ub->first : next_packet(ub, pos);
+		discard_packet(ub, pos);
+		ub->count--;
+	}
+	if (ub->applied)
+		ub->end = ub->last + PACKET(ub, ub->last)->size;
+}
+
+static bool drop_oldest(UndoBuffer* ub)
+{
+	// only applied packets can be dropped; dropping the next packet to
+	// redo would leave redo with a gap.
+	if (!ub->applied)
+		return false;
+	if (ub->evict) {
+		UndoPacket* p = whole_packet(ub, ub->first);
+		if (p)
+			ub->evict(ub->evictObj, p + 1, p->len);
+	}
+	else
+		discard_packet(ub, ub->first);
+	ub->count--;
+	ub->applied--;
+	if (ub->count)
+		ub->first = next_packet(ub, ub->first);
+	return true;
+}
+
+UndoBuffer* undobuf_create(size_t size)
+{
+	UndoBuffer* ub = cpart_new(UndoBuffer);
+	ub->bufsize = (int)(size & ~(size_t)7);
+	ub->buf = cpart_alloc(ub->bufsize);
+	ub->open = -1;
+	return ub;
+}
+
+UndoBuffer* undobuf_create_mapped(size_t size)
+{
+	UndoBuffer* ub;
+	FileMap* map;
+	// packet offsets are ints.
+	if (size > 0x7FFFFFF8)
+		size = 0x7FFFFFF8;
+	map = filemap_create_temp(size & ~(size_t)7, c_mapWindow);
+	if (!map)
+		return 0;
+	ub = cpart_new(UndoBuffer);
+	ub->bufsize = (int)filemap_size(map);
+	ub->map = map;
+	ub->open = -1;
+	return ub;
+}
+
+void undobuf_destroy(UndoBuffer* ub)
+{
+	undobuf_clear(ub);
+	if (ub->map)
+		filemap_destroy(ub->map);
+	else
+		cpart_free(ub->buf);
+	cpart_free(ub);
+}
+
+void undobuf_clear(UndoBuffer* ub)
+{
+	assert(ub->open < 0);
+	ub->applied = 0;
+	drop_redo(ub);
+}
 
-static void* add_record(UndoBuffer* ub, size_t len)
+void undobuf_resize(UndoBuffer* ub, size_t size)
 {
+	// the history does not survive a resize.
+	assert(!ub->map);
+	undobuf_clear(ub);
+	cpart_free(ub->buf);
+	ub->bufsize = (int)(size & ~(size_t)7);
+	ub->buf = cpart_alloc(ub->bufsize);
 }
 
-static void writebuf(UndoBuffer* ub, const byte* buf, size_t len) {
-	memcpy(ub->buf + ub->pos, buf, len);
-	ub->pos += len;
+void undobuf_set_discard(UndoBuffer* ub, UndoBufferApply func, void* obj)
+{
+	ub->discard = func;
+	ub->discardObj = obj;
+}
+
+void undobuf_set_evict(UndoBuffer* ub, UndoBufferApply func, void* obj)
+{
+	ub->evict = func;
+	ub->evictObj = obj;
 }
 
-// writenum costs 7 bits per 8 to store an int.
-#define NUMSIZE ((sizeof(int)*8+6)/7)
+void undobuf_drop_redo(UndoBuffer* ub)
+{
+	assert(ub->open < 0);
+	drop_redo(ub);
+}
 
-static int writenum(byte* buf, int pos, int val)
+void* undobuf_reserve(UndoBuffer* ub, int size)
 {
-	unsigned int bits;
-	// move the sign bit to the least significant bit.
-	// NB. only negatable int values can be encoded.
-	if (val < 0) { bits = (((unsigned int)-val) << 1) | 1; }
-	else { bits = (unsigned int)val << 1; }
-	// pack the bits 7 to a byte.
+	int need;
+	assert(ub->open >= 0);
+	need = ALIGN8(ub->len + size);
+	if (size < 0 || need > ub->bufsize)
+		return 0;
 	for (;;) {
-		unsigned int rem = (bits >> 7);
-		if (rem) {
-			buf[pos++] = (byte)(0x80 | (bits & 0x7f));
-			bits = rem;
-		} else {
-			buf[pos++] = (byte)bits;
+		// the packet can grow up to the oldest packet, or the end of the buffer.
+		int limit = (ub->count && ub->first >= ub->open) ? ub->first : ub->bufsize;
+		if (ub->open + need <= limit)
 			break;
+		if (limit == ub->bufsize && (!ub->count || need <= ub->first)) {
+			// start again at zero, and mark the wrap for the newest packet.
+			move_open(ub);
+			if (ub->count)
+				PACKET(ub, ub->open)->size = 0;
+			ub->open = 0;
+		}
+		else {
+			// make room by discarding the oldest packet.
+			drop_oldest(ub);
 		}
 	}
-	return pos;
+	ub->reserved = size;
+	return buf_at(ub, ub->open + ub->len, size);
+}
+
+void undobuf_commit(UndoBuffer* ub, int size)
+{
+	assert(size >= 0 && size <= ub->reserved);
+	ub->len += size;
+	ub->reserved = 0;
+}
+
+void undobuf_begin(UndoBuffer* ub, void* data, int size)
+{
+	assert(ub->open < 0);
+	drop_redo(ub);
+	ub->open = ub->count ? ub->end : 0;
+	if (ub->open + (int)sizeof(UndoPacket) > ub->bufsize)
+		ub->open = 0; // no room for a wrap mark.
+	ub->len = sizeof(UndoPacket);
+	ub->reserved = 0;
+	// make room for the header.
+	undobuf_reserve(ub, 0);
+	if (size)
+		undobuf_append(ub, data, size);
+}
+
+void undobuf_append(UndoBuffer* ub, void* data, int size)
+{
+	void* p = undobuf_reserve(ub, size);
+	if (p) {
+		memcpy(p, data, size);
+		undobuf_commit(ub, size);
+	}
+}
+
+void undobuf_end(UndoBuffer* ub)
+{
+	UndoPacket* p = PACKET(ub, ub->open);
+	assert(ub->open >= 0);
+	p->size = ALIGN8(ub->len);
+	p->len = ub->len - sizeof(UndoPacket);
+	p->prev = ub->last;
+	if (!ub->count)
+		ub->first = ub->open;
+	ub->last = ub->open;
+	ub->end = ub->open + p->size;
+	ub->count++;
+	ub->applied++;
+	ub->open = -1;
+}
+
+void undobuf_cancel(UndoBuffer* ub)
+{
+	// the open packet is dropped without being discarded.
+	ub->open = -1;
 }
 
-static int readnum(byte* buf, int pos, int* result)
+bool undobuf_undo(UndoBuffer* ub, UndoBufferApply func, void* obj)
 {
-	unsigned int bits = 0;
-	unsigned int val;
+	UndoPacket* p;
+	int prev;
+	assert(ub->open < 0);
+	if (!ub->applied)
+		return false;
+	p = whole_packet(ub, ub->last);
+	if (!p)
+		return false;
+	prev = p->prev; // p can be unmapped by func.
+	func(obj, p + 1, p->len);
+	ub->applied--;
+	if (ub->applied)
+		ub->last = prev;
+	return true;
+}
+
+bool undobuf_redo(UndoBuffer* ub, UndoBufferApply func, void* obj)
+{
+	UndoPacket* p;
+	int pos;
+	assert(ub->open < 0);
+	if (ub->applied == ub->count)
+		return false;
+	pos = ub->applied ? next_packet(ub, ub->last) : ub->first;
+	p = whole_packet(ub, pos);
+	if (!p)
+		return false;
+	func(obj, p + 1, p->len);
+	ub->last = pos;
+	ub->applied++;
+	return true;
+}
+
+bool undobuf_drop_oldest(UndoBuffer* ub)
+{
+	return drop_oldest(ub);
+}
+
+
+// stroke history.
+
+// layers with frameKeepTiles set keep a copy of each tile's pixels the
+// first time it is blended into. at the end of each stroke the kept
+// pixels are xor'd with the pixels now, in place: the delta is zero
+// wherever the stroke left the tile alone. a worker thread compresses
+// the deltas; the main thread records each compressed stroke as one
+// packet as it comes back, in order.
+
+// the delta is its own inverse, so undo and redo are the same: xor the
+// delta into a copy of the layer's pixels as it is unpacked, and hand
+// the result back to the layer.
+// the budget given to undo_create bounds the compressed history.
+
+// with a spill buffer, packets evicted from the history are copied to
+// it. the spill only ever holds strokes older than any in the history,
+// so undo steps back through the history then the spill, and redo the
+// other way; a new stroke drops what can be redone in both.
+
+// layers inserted into or deleted from the document are recorded too,
+// by reference: undo and redo only link the layer back in or take it
+// out, however large it is. a layer out of the document belongs to the
+// packet that took it out, and is destroyed with the packet.
+
+// deltas are packed as 32-bit pixels: a varint count of unchanged
+// pixels, a varint count of changed ones, and the changed pixels as
+// they are. a stroke changes its tiles in solid runs, so this packs
+// well, and unpacking is little more than a copy.
+
+static const int c_jobCapacity = 64;
+
+typedef enum UndoKind {
+	undoStroke = 1,
+	undoInsertLayer,
+	undoDeleteLayer,
+} UndoKind;
+
+typedef struct UndoStroke {
+	int kind;
+	int count;          // UndoTiles follow.
+	Frame* layer;
+} UndoStroke;
+
+typedef struct UndoLayer {
+	int kind;
+	int pos;            // among its parent's children.
+	Frame* layer;
+	Frame* parent;
+	bool detached;      // out of the document, and owned here.
+} UndoLayer;
+
+typedef struct UndoTile {
+	int index;
+	int width, height;
+	int len;            // packed bytes that follow, padded to a multiple of 8.
+} UndoTile;
+
+typedef struct UndoTileJob {
+	int index;
+	int width, height;
+	int len;            // packed bytes, or 0 if the tile did not change.
+	byte* data;         // the delta, then packed.
+} UndoTileJob;
+
+typedef struct UndoJob {
+	Frame* layer;
+	int count;
+	UndoTileJob* tiles;
+} UndoJob;
+
+// worst case: a pair of 3-byte varints for every 3 pixels.
+#define PACK_BOUND(N) ((N) * 6 + 16)
+
+static byte* pack_num(byte* p, unsigned int val)
+{
+	while (val >> 7) {
+		*p++ = (byte)(0x80 | (val & 0x7F));
+		val >>= 7;
+	}
+	*p++ = (byte)val;
+	return p;
+}
+
+static const byte* unpack_num(const byte* p, int* val)
+{
+	unsigned int bits = 0, b;
 	int shift = 0;
 	do {
-		val = buf[pos++];
-		bits |= (val & 0x7F) << shift;
+		b = *p++;
+		bits |= (b & 0x7F) << shift;
 		shift += 7;
-	} while (val & 0x80);
-	if (bits & 1) { *result = -(int)(bits >> 1); } // negative.
-	else { *result = (int)(bits >> 1); } // non-negative.
-	return pos;
-}
-
-static int writeint(byte* buf, int pos, int val) {
-	int i; byte* p = (byte*)&val;
-	for (i=0; i<sizeof(int); i++)
-		buf[pos++] = *p++;
-	return pos;
-}
-
-static int readint(byte* buf, int pos, int* result)
-{
-	int i; byte* p = (byte*)result;
-	for (i=0; i<sizeof(int); i++)
-		*p++ = buf[pos++];
-	return pos;
-}
-
-static void save_rect(UndoBuffer* ub, SurfaceData* sd, int l, int t, int r, int b)
-{
-	// Save a rect of pixels from sd to the undo buffer.
-	// NB. the rect {l,t,r,b} is known to be within bounds.
-	int dx = l, dy = t;
-	int pos, len, height = b-t, width = r-l;
-	byte* src;
-	byte buf[2+5*NUMSIZE];
-
-	// Write rect position and size.
-	buf[0] = tag_rect;
-	pos = writenum(buf, 2, ub->size);
-	pos = writenum(buf, pos, dx);
-	pos = writenum(buf, pos, dy);
-	pos = writenum(buf, pos, width);
-	pos = writenum(buf, pos, height);
-	assert(pos <= sizeof(buf) && pos <= 255+2);
-	buf[1] = pos - 2;
-	writebuf(&ub, buf, pos);
-
-	len = width * 4;
-	ub->size = pos + (len * height);
-
-	// Copy the rect of pixels to the buffer.
-	src = sd->data + (t * sd->stride) + (l * 4);
-	while (height--) {
-		pagebuf_write(&ub->iter, src, len);
-		src += sd->stride;
+	} while (b & 0x80);
+	*val = (int)bits;
+	return p;
+}
+
+static int pack_delta(const uint32* d, int n, byte* out)
+{
+	// a single unchanged pixel is cheaper to store than to end a run on.
+	byte* p = out;
+	int i = 0, start, changed;
+	while (i < n) {
+		start = i;
+		while (i < n && !d[i]) i++;
+		changed = i;
+		while (i < n && (d[i] || (i + 1 < n && d[i + 1]))) i++;
+		p = pack_num(p, changed - start);
+		p = pack_num(p, i - changed);
+		memcpy(p, d + changed, (i - changed) * 4);
+		p += (i - changed) * 4;
 	}
+	return (int)(p - out);
 }
 
-void begin_undo(UndoBuffer* ub, int layer, int size, int spacing, RGBA col)
+static void unpack_delta(const byte* p, uint32* d, int n)
 {
-	byte buf[2+4*NUMSIZE+4];
-	int pos;
-	buf[0] = tag_brush;
-	// Write brush settings.
-	pos = writenum(buf, 2, ub->size);
-	pos = writenum(buf, pos, layer);
-	pos = writenum(buf, pos, size);
-	pos = writenum(buf, pos, spacing);
-	buf[pos++] = (byte)col.r;
-	buf[pos++] = (byte)col.g;
-	buf[pos++] = (byte)col.b;
-	buf[pos++] = (byte)col.a;
-	assert(pos <= sizeof(buf) && pos <= 255+2);
-	buf[1] = pos - 2;
-	pagebuf_write(&ub->iter, buf, pos);
-	ub->size = pos;
-	// Reset "last" clipping rect.
-	ub->last.left = 0; ub->last.top = 0;
-	ub->last.right = 0; ub->last.bottom = 0;
-}
-
-void begin_undo_sample(UndoBuffer* ub, int qx, int qy, int alpha)
-{
-	byte buf[2+3*NUMSIZE+1];
-	int pos;
-	buf[0] = tag_sample;
-	pos = writenum(buf, 2, ub->size);
-	pos = writeint(buf, pos, qx);
-	pos = writeint(buf, pos, qy);
-	buf[pos++] = (byte)alpha;
-	assert(pos <= sizeof(buf) && pos <= 255+2);
-	buf[1] = pos - 2;
-	pagebuf_write(&ub->iter, buf, pos);
-	ub->size = pos;
-}
-
-void end_undo_sample(UndoBuffer* ub)
-{
-}
-
-void save_undo_dab(UndoBuffer* ub, SurfaceData* sd, int left, int top, int width, int height)
-{
-	int right = left + width, bottom = top + height;
-	// Clip the dab rect to the destination surface.
-	if (left < 0) left = 0;
-	if (top < 0) top = 0;
-	if (right > sd->width) right = sd->width;
-	if (bottom > sd->height) bottom = sd->height;
-	if (left < right && top < bottom)
-	{
-		// Clip away the previous dab rect since we have already
-		// saved the pixels underneath it. This certainly still allows
-		// overlap during a stroke, but it's far better than saving the
-		// full rect for every dab.
-		if (top < ub->last.bottom && bottom > ub->last.top &&
-			left < ub->last.right && right > ub->last.left)
-		{
-			// The rects overlap in both X and Y.
-			int c_top = top, c_bottom = bottom;
-			// First deal with parts above and below the prev rect.
-			if (top < ub->last.top) {
-				// There is a stripe above the prev rect.
-				save_rect(ub, sd, left, top, right, ub->last.top);
-				c_top = ub->last.top;
+	// xor the delta into the pixels.
+	byte* dest;
+	int i = 0, same, changed, k;
+	while (i < n) {
+		p = unpack_num(p, &same);
+		p = unpack_num(p, &changed);
+		i += same;
+		assert(i + changed <= n);
+		dest = (byte*)(d + i);
+		for (k=0; k<changed*4; k++)
+			dest[k] ^= p[k];
+		p += changed * 4;
+		i += changed;
+	}
+}
+
+static void compress_job(UndoJob* job)
+{
+	// each delta is packed into scratch, then copied out at its size.
+	byte* scratch = 0;
+	int scratchSize = 0;
+	int i, k, n;
+	for (i=0; i<job->count; i++) {
+		UndoTileJob* tj = &job->tiles[i];
+		const uint32* d = (const uint32*)tj->data;
+		byte* packed;
+		n = tj->width * tj->height;
+		for (k=0; k<n && !d[k]; k++) {}
+		if (k < n) {
+			if (PACK_BOUND(n) > scratchSize) {
+				cpart_free(scratch);
+				scratchSize = PACK_BOUND(n);
+				scratch = cpart_alloc(scratchSize);
 			}
-			if (bottom > ub->last.bottom) {
-				// There is a stripe below the prev rect.
-				save_rect(ub, sd, left, ub->last.bottom, right, bottom);
-				c_bottom = ub->last.bottom;
+			tj->len = pack_delta(d, n, scratch);
+			packed = cpart_alloc(tj->len);
+			memcpy(packed, scratch, tj->len);
+		}
+		else {
+			// blended into, but left as it was.
+			packed = 0;
+			tj->len = 0;
+		}
+		cpart_free(tj->data);
+		tj->data = packed;
+	}
+	cpart_free(scratch);
+}
+
+static unsigned long compress_run(void* data)
+{
+	UndoBuffer* ub = data;
+	UndoJob* job;
+	for (;;) {
+		while (spscring_pop(ub->jobs, &job)) {
+			if (!job)
+				return 0;
+			compress_job(job);
+			// the main thread records strokes as it merges paint.
+			while (!spscring_push(ub->done, &job)) {
+				app_wake();
+				thread_yield();
 			}
-			// Only the left and right stripes remain.
-			// top and bottom have been clipped to the overlap area.
-			if (left < ub->last.left) {
-				save_rect(ub, sd, left, c_top, ub->last.left, c_bottom);
+			app_wake();
+		}
+		thread_signal_wait(ub->wake);
+	}
+}
+
+static void free_job(UndoJob* job)
+{
+	int i;
+	for (i=0; i<job->count; i++)
+		cpart_free(job->tiles[i].data);
+	cpart_free(job->tiles);
+	cpart_free(job);
+}
+
+static bool store_stroke(UndoBuffer* to, UndoJob* job, int count, int size)
+{
+	// one packet for the stroke; false if it does not fit.
+	UndoStroke* s;
+	UndoTile* ut;
+	int i;
+	undobuf_begin(to, 0, 0);
+	s = undobuf_reserve(to, size);
+	if (!s) {
+		undobuf_cancel(to);
+		return false;
+	}
+	s->kind = undoStroke;
+	s->count = count;
+	s->layer = job->layer;
+	ut = (UndoTile*)(s + 1);
+	for (i=0; i<job->count; i++) {
+		UndoTileJob* tj = &job->tiles[i];
+		if (!tj->len)
+			continue;
+		ut->index = tj->index;
+		ut->width = tj->width;
+		ut->height = tj->height;
+		ut->len = tj->len;
+		memcpy(ut + 1, tj->data, tj->len);
+		ut = (UndoTile*)((byte*)(ut + 1) + ALIGN8(tj->len));
+	}
+	undobuf_commit(to, size);
+	undobuf_end(to);
+	return true;
+}
+
+static void record_stroke(UndoBuffer* ub, UndoJob* job)
+{
+	int i, count = 0, size = sizeof(UndoStroke);
+	for (i=0; i<job->count; i++) {
+		if (job->tiles[i].len) {
+			count++;
+			size += sizeof(UndoTile) + ALIGN8(job->tiles[i].len);
+		}
+	}
+	if (count) {
+		if (ub->spill)
+			undobuf_drop_redo(ub->spill);
+		if (!store_stroke(ub, job, count, size)) {
+			// bigger than the whole history. each delta only undoes
+			// onto the pixels the strokes after it left, so the history
+			// moves to the spill, and the stroke goes in after it.
+			bool kept = false;
+			if (ub->spill) {
+				while (undobuf_drop_oldest(ub)) {}
+				kept = store_stroke(ub->spill, job, count, size);
 			}
-			if (right > ub->last.right) {
-				save_rect(ub, sd, ub->last.right, c_top, right, c_bottom);
+			if (!kept) {
+				// nothing before this stroke can be undone now.
+				undobuf_clear(ub);
+				if (ub->spill)
+					undobuf_clear(ub->spill);
 			}
 		}
-		else
-		{
-			// No overlap - copy the entire new rect.
-			save_rect(ub, sd, left, top, right, bottom);
-		}
-		// Save the new previous dab rect (clipped to sd)
-		ub->last.left = left;
-		ub->last.top = top;
-		ub->last.right = right;
-		ub->last.bottom = bottom;
 	}
+	free_job(job);
+}
+
+static void take_delta(UndoTileJob* tj, FrameTile* before, SurfaceData* after)
+{
+	// xor the kept pixels with the pixels now, in place.
+	uint32* d = (uint32*)before->pixels.data;
+	const uint32* s = (const uint32*)after->data;
+	int i, n = before->pixels.width * before->pixels.height;
+	assert(after->width == before->pixels.width && after->height == before->pixels.height);
+	for (i=0; i<n; i++)
+		d[i] ^= s[i];
+	// the job owns the delta from here.
+	tj->index = before->index;
+	tj->width = before->pixels.width;
+	tj->height = before->pixels.height;
+	tj->len = 0;
+	tj->data = before->pixels.data;
 }
 
-static void applyUndoRect(UndoBuffer* ub, byte* buf)
-{
-	int pos, dx, dy, width, height;
-	pos = readnum(buf, 0, &dx);
-	pos = readnum(buf, pos, &dy);
-	pos = readnum(buf, pos, &width);
-	pos = readnum(buf, pos, &height);
-	// copy the rect of pixels.
-	if (activeLayer) {
-		/* -- make some sort of SpanSource iterator?
-		SurfaceData* sd = &activeLayer->sd;
-		// safety checks.
-		if (width > 0 && height > 0 && ub->x + width <= sd->width && ub->y + height <= sd->height) {
-			int len = width * 4;
-			byte* dest = sd->data + (ub->y * sd->stride) + (ub->x * 4);
-			while (height--) {
-				pagebuf_read(&ub->iter, dest, len);
-				dest += sd->stride;
+static void apply_stroke(void* obj, void* data, int size)
+{
+	UndoBuffer* ub = obj;
+	UndoStroke* s = data;
+	UndoTile* ut = (UndoTile*)(s + 1);
+	FrameTile ft;
+	FrameTiles t;
+	int i;
+	t.tiles = &ft;
+	t.count = 1;
+	for (i=0; i<s->count; i++) {
+		ft.index = ut->index;
+		s->layer->message(s->layer, frameGetTiles, &t);
+		if (ft.pixels.width == ut->width && ft.pixels.height == ut->height) {
+			// the layer's pixels are read only: the layer copies the
+			// result back, and may drop the tile if it is left clear.
+			if (ub->sd.width != ut->width || ub->sd.height != ut->height) {
+				surface_destroy(&ub->sd);
+				surface_create(&ub->sd, surface_rgba8, ut->width, ut->height);
 			}
+			surface_copy(&ub->sd, 0, 0, &ft.pixels);
+			unpack_delta((const byte*)(ut + 1), (uint32*)ub->sd.data, ut->width * ut->height);
+			ft.pixels = ub->sd;
+			s->layer->message(s->layer, frameUpdateTiles, &t);
 		}
-		*/
+		ut = (UndoTile*)((byte*)(ut + 1) + ALIGN8(ut->len));
 	}
-	// adjust current x,y by stored delta.
-	ub->x -= dx; ub->y -= dy;
-	assert(ub->x >= 0 && ub->y >= 0);
-}
-
-static void applyUndoBrush(byte* buf)
-{
-	int pos, layer, size, spacing;
-	RGBA col;
-	pos = readnum(buf, 0, &layer);
-	pos = readnum(buf, pos, &size);
-	pos = readnum(buf, pos, &spacing);
-	col.r = buf[pos++];
-	col.g = buf[pos++];
-	col.b = buf[pos++];
-	col.a = buf[pos++];
-	// TODO: what if the layer was deleted?
-	// undo deleting the layer? or invalidate undo for that layer?
-	active_layer(layer);
-	set_brush_size(size, size, spacing); // TODO: min/max
-	set_brush_col(col);
-}
-
-static int undoEntry(UndoBuffer* ub)
-{
-	byte buf[256];
-	int tag, pos, prevSize;
-	size_t checkOne = pagebuf_tell(&ub->iter);
-	size_t checkTwo, checkThree;
-	// check if undo buffer contains any entries.
-	if (ub->size == 0)
-		return tag_none;
-	// rewind to the beginning of the latest entry.
-	pagebuf_rewind(&ub->iter, ub->size);
-	checkTwo = pagebuf_tell(&ub->iter);
-	// TODO: this fails on a page cross.
-	assert(checkTwo + ub->size == checkOne);
-	// read the entry header and previous entry size.
-	pagebuf_read(&ub->iter, buf, 2);
-	tag = buf[0];
-	assert(buf[1] != 0);
-	pagebuf_read(&ub->iter, buf, buf[1]);
-	pos = readnum(buf, 0, &prevSize);
-	assert(prevSize >= 0);
-	// evaluate the entry.
-	switch (tag)
-	{
-	case tag_rect: applyUndoRect(ub, buf + pos); break;
-	case tag_sample: /* igore sample data */ break;
-	case tag_brush: applyUndoBrush(buf + pos); break;
-	default: assert(0); break;
+}
+
+static void detach_layer(UndoLayer* l)
+{
+	remove_layer(l->layer);
+	l->detached = true;
+}
+
+static void attach_layer(UndoLayer* l)
+{
+	insert_frame(l->layer, l->parent, l->pos);
+	l->detached = false;
+}
+
+static void apply_undo(void* obj, void* data, int size)
+{
+	switch (*(int*)data) {
+	case undoStroke: apply_stroke(obj, data, size); break;
+	case undoInsertLayer: detach_layer(data); break;
+	case undoDeleteLayer: attach_layer(data); break;
 	}
-	checkThree = pagebuf_tell(&ub->iter);
-	assert(checkThree == checkOne);
-	// rewind to the beginning of the entry again.
-	pagebuf_rewind(&ub->iter, ub->size);
-	checkThree = pagebuf_tell(&ub->iter);
-	assert(checkThree == checkTwo);
-	ub->size = prevSize;
-	return tag;
 }
 
-static int redoEntry(UndoBuffer* ub)
+static void apply_redo(void* obj, void* data, int size)
 {
-	// must assume ub->iter is at eof or a header.
+	switch (*(int*)data) {
+	case undoStroke: apply_stroke(obj, data, size); break;
+	case undoInsertLayer: attach_layer(data); break;
+	case undoDeleteLayer: detach_layer(data); break;
+	}
 }
 
-void undo(UndoBuffer* ub)
+static void discard_entry(void* obj, void* data, int size)
 {
-	// apply entries until a brush entry is found.
-	int tag;
-	do { tag = undoEntry(ub); } while (tag == tag_rect || tag == tag_sample);
-	// repaint the client.
-	invalidate_all();
+	UndoLayer* l = data;
+	if (l->kind != undoStroke && l->detached)
+		destroy_frame(l->layer);
 }
 
-void redo(UndoBuffer* ub)
+static void record_layer(UndoBuffer* ub, UndoKind kind, Frame* layer)
 {
+	UndoLayer* l;
+	Frame* walk;
+	// strokes still being compressed came first.
+	undo_flush(ub);
+	if (ub->spill)
+		undobuf_drop_redo(ub->spill);
+	undobuf_begin(ub, 0, 0);
+	l = undobuf_reserve(ub, sizeof(UndoLayer));
+	if (l) {
+		l->kind = kind;
+		l->layer = layer;
+		l->parent = layer->parent;
+		l->pos = 0;
+		for (walk = layer->parent->children; walk && walk != layer; walk = walk->next)
+			l->pos++;
+		l->detached = false;
+		if (kind == undoDeleteLayer)
+			detach_layer(l);
+		undobuf_commit(ub, sizeof(UndoLayer));
+		undobuf_end(ub);
+	}
+	else {
+		undobuf_cancel(ub);
+		if (kind == undoDeleteLayer)
+			destroy_frame(layer);
+	}
 }
 
-UndoBuffer* undobuf_create(size_t size)
+static void spill_stroke(void* obj, void* data, int size)
 {
-	UndoBuffer* ub = cpart_new(UndoBuffer);
-	ub->buf = cpart_alloc(size);
+	UndoBuffer* spill = obj;
+	void* p;
+	undobuf_begin(spill, 0, 0);
+	p = undobuf_reserve(spill, size);
+	if (p) {
+		memcpy(p, data, size);
+		undobuf_commit(spill, size);
+		undobuf_end(spill);
+	}
+	else {
+		// no room, or the file could not be mapped: lost after all, and
+		// the older strokes with it, which only undo in sequence.
+		undobuf_cancel(spill);
+		discard_entry(0, data, size);
+		undobuf_clear(spill);
+	}
+}
+
+UndoBuffer* undo_create(size_t size)
+{
+	UndoBuffer* ub = undobuf_create(size);
+	undobuf_set_discard(ub, discard_entry, 0);
+	ub->jobs = spscring_create(sizeof(UndoJob*), c_jobCapacity);
+	ub->done = spscring_create(sizeof(UndoJob*), c_jobCapacity);
+	ub->wake = thread_signal_create();
+	ub->thread = thread_create(compress_run, ub);
 	return ub;
 }
+
+void undo_destroy(UndoBuffer* ub)
+{
+	UndoJob* quit = 0;
+	undo_set_spill(ub, 0);
+	undo_flush(ub);
+	// nothing is pending, so there is room for the quit.
+	spscring_push(ub->jobs, &quit);
+	thread_signal_raise(ub->wake);
+	thread_join(ub->thread);
+	thread_signal_destroy(ub->wake);
+	spscring_destroy(ub->done);
+	spscring_destroy(ub->jobs);
+	surface_destroy(&ub->sd);
+	undobuf_destroy(ub);
+}
+
+void undo_set_spill(UndoBuffer* ub, size_t size)
+{
+	undo_flush(ub);
+	if (ub->spill) {
+		undobuf_set_evict(ub, 0, 0);
+		undobuf_destroy(ub->spill);
+		ub->spill = 0;
+	}
+	if (size) {
+		ub->spill = undobuf_create_mapped(size);
+		if (ub->spill) {
+			undobuf_set_discard(ub->spill, discard_entry, 0);
+			undobuf_set_evict(ub, spill_stroke, ub->spill);
+		}
+	}
+}
+
+void undo_collect(UndoBuffer* ub)
+{
+	UndoJob* job;
+	while (spscring_pop(ub->done, &job)) {
+		record_stroke(ub, job);
+		ub->pending--;
+	}
+}
+
+void undo_flush(UndoBuffer* ub)
+{
+	while (ub->pending) {
+		undo_collect(ub);
+		if (ub->pending)
+			thread_yield();
+	}
+}
+
+void undo_insert_layer(UndoBuffer* ub, Frame* layer)
+{
+	record_layer(ub, undoInsertLayer, layer);
+}
+
+void undo_delete_layer(UndoBuffer* ub, Frame* layer)
+{
+	record_layer(ub, undoDeleteLayer, layer);
+}
+
+void undo_clear(UndoBuffer* ub)
+{
+	undo_flush(ub);
+	undobuf_clear(ub);
+	if (ub->spill)
+		undobuf_clear(ub->spill);
+}
+
+void undo_end_stroke(UndoBuffer* ub, Frame* layer)
+{
+	FrameTiles kept, cur;
+	UndoJob* job;
+	int i;
+	if (!layer)
+		return;
+	layer->message(layer, frameTakeTiles, &kept);
+	if (kept.count) {
+		// the pixels the kept ones became.
+		cur.count = kept.count;
+		cur.tiles = cpart_alloc(kept.count * sizeof(FrameTile));
+		memcpy(cur.tiles, kept.tiles, kept.count * sizeof(FrameTile));
+		layer->message(layer, frameGetTiles, &cur);
+
+		job = cpart_new(UndoJob);
+		job->layer = layer;
+		job->count = kept.count;
+		job->tiles = cpart_alloc(kept.count * sizeof(UndoTileJob));
+		for (i=0; i<kept.count; i++)
+			take_delta(&job->tiles[i], &kept.tiles[i], &cur.tiles[i].pixels);
+		cpart_free(cur.tiles);
+
+		ub->pending++;
+		while (!spscring_push(ub->jobs, &job)) {
+			// the worker is waiting for its results to be taken.
+			undo_collect(ub);
+			thread_signal_raise(ub->wake);
+			thread_yield();
+		}
+		thread_signal_raise(ub->wake);
+	}
+	cpart_free(kept.tiles);
+}
+
+void undo(UndoBuffer* ub)
+{
+	// strokes still being painted or compressed must be recorded first.
+	finish_painting();
+	undo_flush(ub);
+	if (undobuf_undo(ub, apply_undo, ub) ||
+		(ub->spill && undobuf_undo(ub->spill, apply_undo, ub)))
+		invalidate_all();
+}
+
+void redo(UndoBuffer* ub)
+{
+	finish_painting();
+	undo_flush(ub);
+	if ((ub->spill && undobuf_redo(ub->spill, apply_redo, ub)) ||
+		undobuf_redo(ub, apply_redo, ub))
+		invalidate_all();
+}